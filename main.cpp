@@ -1,17 +1,141 @@
 #include <SDL.h>
+#ifndef PROFILING
+#define PROFILING 1   // -DPROFILING=0 вырезает все таймеры и трассировку
+#endif
+#ifndef HEADLESS
 #include <SDL_ttf.h>
+#endif
 #include <math.h>
+#include <stdio.h>
 #include <vector>
 #include <algorithm>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <chrono>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>            // отображение записи в память при воспроизведении
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(HEADLESS) && defined(__linux__)
+#include <linux/perf_event.h>   // счётчик промахов кэша в замере
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 int SCREEN_WIDTH = 1080;
 int SCREEN_HEIGHT = 1340;
-int BALLS_COUNT = 2000;
+int WORLD_WIDTH = 1080;          // мир физики; окно смотрит на него через камеру
+int WORLD_HEIGHT = 1340;
+int BALLS_COUNT = 2000;          // шаров на старте; эмиттеры и зоны удаления меняют число на ходу
+int BALL_CAPACITY = 0;           // --capacity: предел шаров, память под него берётся сразу; 0 — см. ball_capacity()
 int MIN_SIZE = 5;
 int MAX_SIZE = 10;
 float GRAVITY = 500;
-int RESOLVE_STEPS = 64;
+int RESOLVE_STEPS = 32;          // итераций солвера на тик, делятся между подшагами
+int PHYSICS_HZ = 60;             // фиксированная частота физики
+int SUBSTEPS = 4;                // подшагов на тик
+int MAX_TICKS_PER_FRAME = 5;     // больше за кадр не догоняем, остаток выбрасываем
+float MAX_DISPLACEMENT = 5.0f;   // ограничение смещения за подшаг
+int CONTINUOUS_COLLISION = 0;    // --ccd: быстрые шары заметаются на подшаге и не проходят сквозь других
+float CCD_MAX_DISPLACEMENT = 120.0f;  // срезка смещения с --ccd: только от разлёта, туннелирование ловит заметание
+float CEILING_OUT_OF_SCREEN = 1080;  // потолок выше мира: стартовая стопка init_balls выше окна
 float EXPLOSION_STRENGTH = 5;
+float ATTRACTOR_STRENGTH = 3000;  // px/s^2 в центре притяжения (правая кнопка мыши)
+float WIND_STRENGTH = 1500;       // px/s^2 порыва ветра [W]
+
+enum BroadPhaseMode {
+    BROAD_PHASE_SWEEP,  // сортировка по X и проход по одной оси
+    BROAD_PHASE_GRID,   // равномерная сетка, корзины через counting sort
+    BROAD_PHASE_COUNT
+};
+int BROAD_PHASE = BROAD_PHASE_GRID;
+
+enum PbdKernel {
+    PBD_KERNEL_SCALAR,  // по одному контакту
+    PBD_KERNEL_SIMD,    // SSE по 4 / AVX2 по 8 независимых контактов
+    PBD_KERNEL_COUNT
+};
+int PBD_KERNEL = PBD_KERNEL_SIMD;
+
+enum SolverMode {
+    SOLVER_SERIAL,       // раскрашенные батчи Гаусса-Зейделя в одном потоке
+    SOLVER_PARALLEL_GS,  // те же батчи, каждый батч делится между потоками
+    SOLVER_JACOBI,       // Якоби: поправки копятся по шарам и усредняются
+    SOLVER_MODE_COUNT
+};
+int SOLVER_MODE = SOLVER_PARALLEL_GS;
+
+enum CollisionSolver {
+    COLLISION_NAIVE,      // раздвигаем поровну и гасим сближение, как в самой первой версии
+    COLLISION_IMPULSE,    // то же на Vec2
+    COLLISION_BAUMGARTE,  // частичная позиционная коррекция, затухающая к последней итерации
+    COLLISION_PBD,        // накопленные лямбды, батчи и тёплый старт; вариант — SOLVER_MODE
+    COLLISION_SOLVER_COUNT
+};
+int COLLISION_SOLVER = COLLISION_PBD;
+const char* COLLISION_SOLVER_NAMES[COLLISION_SOLVER_COUNT] = {"naive", "impulse", "baumgarte", "pbd"};
+
+enum Integrator {
+    INTEGRATOR_VERLET,    // по прошлой позиции, со срезкой смещения MAX_DISPLACEMENT
+    INTEGRATOR_VELOCITY,  // явный Эйлер по vel
+    INTEGRATOR_COUNT
+};
+int INTEGRATOR = INTEGRATOR_VERLET;
+const char* INTEGRATOR_NAMES[INTEGRATOR_COUNT] = {"verlet", "velocity"};
+
+enum Boundary {
+    BOUNDARY_CLAMP,   // прижать к стене, отразить только vel
+    BOUNDARY_BOUNCE,  // прижать и отразить движение обоих интеграторов
+    BOUNDARY_COUNT
+};
+int BOUNDARY = BOUNDARY_CLAMP;
+const char* BOUNDARY_NAMES[BOUNDARY_COUNT] = {"clamp", "bounce"};
+
+enum RenderMode {
+    RENDER_LINES,            // по линии на сегмент, как раньше
+    RENDER_BATCHED_OUTLINE,  // все контуры одной геометрией
+    RENDER_BATCHED_FILLED,   // все диски одной геометрией
+    RENDER_SOFTWARE,         // свой растеризатор по тайлам экрана в потоках, одна текстура на кадр
+    RENDER_MODE_COUNT
+};
+int RENDER_MODE = RENDER_BATCHED_FILLED;
+int THREADS_COUNT = 0;            // 0 — по числу ядер
+int RENDER_THREADS = 0;           // потоков программного растеризатора, 0 — половина ядер
+float JACOBI_RELAXATION = 1.5f;   // пересила для усреднённых поправок Якоби
+float WARM_START = 0.5f;          // доля прошлой лямбды контакта для тёплого старта, 0 — выключен
+float SOLVER_TOLERANCE = 0.05f;   // px: итерации солвера кончаются, когда проникновение меньше; 0 — всегда RESOLVE_STEPS
+float CONTACT_MARGIN = 1.0f;      // пары ближе r + margin остаются контактами, чтобы покоящиеся не мигали в кэше
+int REORDER_INTERVAL = 0;         // тиков между перестановками шаров по Мортону, 0 — выключено
+int SLEEPING = 1;                 // усыплять успокоившиеся острова шаров
+float SLEEP_DISTANCE = 1.0f;      // дальше этого от опорной точки шар считается движущимся
+float SLEEP_TIME = 0.5f;          // секунд неподвижности до сна
+int BENCH_TICKS = 600;            // тиков в headless-замере
+unsigned BENCH_SEED = 1;
+int BENCH_FIELDS = 0;             // --fields: случайных взрывов за тик в замере
+const char* TRACE_PATH = NULL;    // --trace: куда писать trace.json
+const char* RECORD_PATH = NULL;   // --record: писать прогон в файл
+const char* REPLAY_PATH = NULL;   // --replay: показывать запись вместо симуляции
+const char* SUITE_PATH = NULL;    // --suite: CSV сравнения солверов
+const char* SCENE_PATH = NULL;    // --scene: статические отрезки и многоугольники
+std::vector<int> SUITE_BALLS = {1000, 10000, 50000, 200000};
+std::vector<int> SUITE_ITERATIONS = {8, 16, 32};
 
 struct Vec2 {
     float x, y;
@@ -72,16 +196,745 @@ struct Ball {
     bool colliding = false;
 };
 
+// Аллокатор с выравниванием, чтобы массивы BallStorage грузились целыми векторными регистрами
+template <typename T, size_t Alignment = 32>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+template <typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+// Внешняя ссылка на шар, переживающая перестановки и удаления: слот и его поколение.
+// Поколение растёт при освобождении слота, так что ссылка на удалённый шар не оживёт
+struct BallHandle {
+    uint32_t slot = UINT32_MAX;
+    uint32_t generation = 0;
+};
+
+// Шары в виде structure-of-arrays: горячие координаты и радиусы лежат отдельными
+// плотными массивами, цвет и скорость — отдельно, чтобы не тянуть их в кэш в солвере
+struct BallStorage {
+    aligned_vector<float> x, y;
+    aligned_vector<float> prev_x, prev_y;
+    aligned_vector<float> radius;
+
+    aligned_vector<float> vel_x, vel_y;
+    aligned_vector<float> tick_x, tick_y;  // позиция в начале тика, для интерполяции при отрисовке
+    std::vector<SDL_Color> color;
+    std::vector<Uint8> colliding;
+
+    std::vector<Uint8> asleep;
+    aligned_vector<float> anchor_x, anchor_y;  // где шар стоял, когда начал успокаиваться
+    std::vector<float> still_time;             // сколько секунд он не отходил от опорной точки
+    std::vector<int> sleep_island;             // id острова, с которым шар уснул
+    std::vector<uint32_t> slot;                // слот шара в пуле
+
+    // Пул слотов: слот -> индекс в плотных массивах (-1 — свободен), поколение, список свободных
+    std::vector<int> slot_index;
+    std::vector<uint32_t> slot_generation;
+    std::vector<uint32_t> free_slots;
+
+    int size() const { return (int)x.size(); }
+
+    void clear() {
+        x.clear(); y.clear();
+        prev_x.clear(); prev_y.clear();
+        radius.clear();
+        vel_x.clear(); vel_y.clear();
+        tick_x.clear(); tick_y.clear();
+        color.clear();
+        colliding.clear();
+        asleep.clear();
+        anchor_x.clear(); anchor_y.clear();
+        still_time.clear();
+        sleep_island.clear();
+        slot.clear();
+        slot_index.clear();
+        slot_generation.clear();
+        free_slots.clear();
+    }
+
+    void reserve(int n) {
+        x.reserve(n); y.reserve(n);
+        prev_x.reserve(n); prev_y.reserve(n);
+        radius.reserve(n);
+        vel_x.reserve(n); vel_y.reserve(n);
+        tick_x.reserve(n); tick_y.reserve(n);
+        color.reserve(n);
+        colliding.reserve(n);
+        asleep.reserve(n);
+        anchor_x.reserve(n); anchor_y.reserve(n);
+        still_time.reserve(n);
+        sleep_island.reserve(n);
+        slot.reserve(n);
+        slot_index.reserve(n);
+        slot_generation.reserve(n);
+        free_slots.reserve(n);
+    }
+
+    int capacity() const { return (int)x.capacity(); }
+
+    void push_back(const Ball& b) {
+        x.push_back(b.pos.x); y.push_back(b.pos.y);
+        prev_x.push_back(b.prev_pos.x); prev_y.push_back(b.prev_pos.y);
+        radius.push_back(b.radius);
+        vel_x.push_back(b.vel.x); vel_y.push_back(b.vel.y);
+        tick_x.push_back(b.pos.x); tick_y.push_back(b.pos.y);
+        color.push_back(b.color);
+        colliding.push_back(b.colliding);
+        asleep.push_back(0);
+        anchor_x.push_back(b.pos.x); anchor_y.push_back(b.pos.y);
+        still_time.push_back(0.0f);
+        sleep_island.push_back(-1);
+
+        uint32_t s;
+        if (!free_slots.empty()) {
+            s = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            s = (uint32_t)slot_index.size();
+            slot_index.push_back(-1);
+            slot_generation.push_back(0);
+        }
+        slot_index[s] = size() - 1;
+        slot.push_back(s);
+    }
+
+    BallHandle handle(int i) const {
+        BallHandle h;
+        h.slot = slot[i];
+        h.generation = slot_generation[slot[i]];
+        return h;
+    }
+
+    // -1, если шар удалён
+    int index(BallHandle h) const {
+        if (h.slot >= slot_index.size() || slot_generation[h.slot] != h.generation)
+            return -1;
+        return slot_index[h.slot];
+    }
+
+    Vec2 pos(int i) const { return Vec2(x[i], y[i]); }
+
+    // Переставляет шары: новый k-й шар — это старый order[k]. Шары, которых нет в order,
+    // удаляются — их слоты надо сначала освободить через free_slot
+    void permute(const std::vector<int>& order) {
+        permute_array(x, order); permute_array(y, order);
+        permute_array(prev_x, order); permute_array(prev_y, order);
+        permute_array(radius, order);
+        permute_array(vel_x, order); permute_array(vel_y, order);
+        permute_array(tick_x, order); permute_array(tick_y, order);
+        permute_array(color, order);
+        permute_array(colliding, order);
+        permute_array(asleep, order);
+        permute_array(anchor_x, order); permute_array(anchor_y, order);
+        permute_array(still_time, order);
+        permute_array(sleep_island, order);
+        permute_array(slot, order);
+        for (int k = 0; k < size(); ++k)
+            slot_index[slot[k]] = k;
+    }
+
+    void free_slot(int i) {
+        uint32_t s = slot[i];
+        slot_index[s] = -1;
+        slot_generation[s]++;
+        free_slots.push_back(s);
+    }
+
+    // scratch берёт ёмкость массива: после swap у массива остаётся запас под новые шары
+    template <typename V>
+    static void permute_array(V& v, const std::vector<int>& order) {
+        static V scratch;
+        scratch.reserve(v.capacity());
+        scratch.resize(order.size());
+        for (size_t k = 0; k < order.size(); ++k)
+            scratch[k] = v[order[k]];
+        v.swap(scratch);
+    }
+};
+
 struct BallPair {
     int a, b;
     float penetration = 0.0f; // чем больше — тем важнее обрабатывать раньше
+    float lambda = 0.0f;      // накопленная поправка солвера, переживает подшаг через кэш контактов
+};
+
+// Буферы детекции живут между подшагами: в установившемся режиме кучу не трогаем
+std::vector<BallPair> contact_pairs;
+
+// Статическая геометрия сцены: отрезки и выпуклые многоугольники из файла --scene.
+// Коллайдеры лежат в BVH, так что шар проверяет только листья, чьи рамки задевает,
+// а контакты с ними решаются теми же итерациями, что и контакты шаров
+enum ColliderShape {
+    COLLIDER_SEGMENT,   // две вершины
+    COLLIDER_POLYGON,   // выпуклый, вершины по часовой стрелке на экране (y вниз)
+};
+
+struct StaticCollider {
+    int shape;
+    int first, count;   // вершины в static_vertices, у многоугольника там же нормали рёбер
+    float min_x, min_y, max_x, max_y;
+};
+
+// Лист: коллайдеры [first, first + count). Внутренний узел: count == 0, дети first и first + 1
+struct BvhNode {
+    float min_x, min_y, max_x, max_y;
+    int first, count;
+};
+
+const int BVH_LEAF_SIZE = 2;
+const int BVH_MAX_DEPTH = 64;
+
+std::vector<StaticCollider> static_colliders;
+std::vector<Vec2> static_vertices;
+std::vector<Vec2> static_normals;    // внешняя нормаль ребра vertices[k] -> vertices[k + 1]
+std::vector<BvhNode> bvh_nodes;
+
+// Контакты подшага идут по возрастанию шара; группа — все контакты одного шара,
+// группы независимы и делятся между потоками
+struct StaticContact {
+    int ball, collider;
+    Vec2 side;  // для отрезка: нормаль в сторону, где был центр шара при сборе контакта
+};
+
+std::vector<StaticContact> static_contacts;
+std::vector<int> static_group_start;
+
+// visit(номер коллайдера) для каждого коллайдера, чья рамка пересекает [min, max]
+template <class Visit>
+void query_bvh(float min_x, float min_y, float max_x, float max_y, Visit visit) {
+    if (bvh_nodes.empty())
+        return;
+    int stack[BVH_MAX_DEPTH + 1];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const BvhNode& n = bvh_nodes[stack[--top]];
+        if (n.min_x > max_x || n.max_x < min_x || n.min_y > max_y || n.max_y < min_y)
+            continue;
+        if (n.count == 0) {
+            stack[top++] = n.first;
+            stack[top++] = n.first + 1;
+            continue;
+        }
+        for (int i = n.first; i < n.first + n.count; ++i) {
+            const StaticCollider& c = static_colliders[i];
+            if (c.min_x <= max_x && c.max_x >= min_x && c.min_y <= max_y && c.max_y >= min_y)
+                visit(i);
+        }
+    }
+}
+
+// Эмиттер — сопло шириной width с центром в pos: rate шаров в секунду со скоростью
+// velocity (px/s), направление разбрасывается на ±spread радиан. При limit > 0 живых шаров
+// эмиттера не больше limit: самые старые удаляются по ссылкам из кольца handles
+struct Emitter {
+    Vec2 pos;
+    Vec2 velocity;
+    float rate = 0.0f;
+    float width = 0.0f;
+    float spread = 0.0f;
+    int limit = 0;
+    float pending = 0.0f;             // шары, ещё не вышедшие из сопла
+    float travel = 0.0f;              // сколько прошёл последний ряд
+    std::vector<BallHandle> handles;  // кольцо на limit ссылок
+    int next = 0;
+};
+
+// Шары, чей центр попал в прямоугольник, удаляются в начале тика
+struct KillZone {
+    float min_x, min_y, max_x, max_y;
+};
+
+std::vector<Emitter> emitters;
+std::vector<KillZone> kill_zones;
+
+// Тела из сцены: цепочка, ткань и кольцо. Шары и связи создаёт spawn_scene_bodies в init_balls
+enum BodyShape {
+    BODY_CHAIN,   // count шаров от origin до end, соседи связаны
+    BODY_CLOTH,   // сетка cols x rows с шагом size от origin: связи по сторонам и диагоналям
+    BODY_RING,    // count шаров по окружности радиуса size вокруг origin, с распорками
+};
+
+struct SceneBody {
+    int shape;
+    Vec2 origin, end;
+    int cols = 1, rows = 1;   // у цепочки и кольца шаров — cols
+    float size = 0.0f;
+    float compliance = 0.0f;
+    float min_x, min_y, max_x, max_y;   // рамка созданных шаров вместе с радиусом
+};
+
+std::vector<SceneBody> scene_bodies;
+std::vector<Vec2> scene_pins;     // закрепляется ближайший шар тел
+
+// Связи расстояния: |x_b - x_a| держится около rest. XPBD: compliance — податливость
+// (0 — жёсткая связь), лямбда копится за подшаг, wa/wb — обратные массы, 0 у закреплённого.
+// Связи между подшагами не меняются, поэтому раскрашены один раз при создании: в батче шар
+// встречается не больше раза, батч решается параллельно и SIMD, как контакты
+struct DistanceConstraints {
+    std::vector<int> a, b;
+    aligned_vector<float> rest;
+    aligned_vector<float> compliance;
+    aligned_vector<float> wa, wb;
+    aligned_vector<float> lambda;
+    std::vector<int> batch_start;   // MAX_CONTACT_COLORS + 1 батчей, последний — конфликтный
+};
+
+DistanceConstraints distance_constraints;
+
+// Закреплённый шар после каждого прохода связей возвращается в свою точку
+struct Pins {
+    std::vector<int> ball;
+    std::vector<float> x, y;
+};
+
+Pins pins;
+
+// Время по фазам кадра, копится с начала замера
+enum Phase {
+    PHASE_FIELDS,
+    PHASE_INTEGRATE,
+    PHASE_BROAD,
+    PHASE_NARROW,
+    PHASE_SORT,
+    PHASE_SOLVE,
+    PHASE_DRAW,
+    PHASE_TEXT,
+    PHASE_COUNT
+};
+const char* PHASE_NAMES[PHASE_COUNT] = {"force fields", "integrate", "broad phase", "narrow phase", "sort", "solve", "draw", "text"};
+double phase_seconds[PHASE_COUNT];
+float phase_frame_ms[PHASE_COUNT];   // сглаженное время фаз за кадр, для HUD
+
+int stat_candidates = 0;   // пары из broad phase на последнем подшаге
+int stat_contacts = 0;     // из них реально пересекающихся
+int stat_contacts_kept = 0;    // контакты, найденные в кэше прошлого подшага
+int stat_contacts_added = 0;
+int stat_contacts_removed = 0;
+int stat_sweep_swaps = 0;      // перестановок при досортировке sweep and prune
+int stat_sleeping = 0;         // спящих шаров после последнего тика
+int stat_islands = 0;          // спящих островов
+int stat_field_balls = 0;      // сколько шаров проверили силовые поля на последнем тике
+int stat_solver_iterations = 0;    // итераций солвера на последнем подшаге
+int stat_static_contacts = 0;      // касаний шаров со статической геометрией на последнем подшаге
+int stat_spawned = 0, stat_killed = 0;    // шаров родилось и удалено на последнем тике
+int stat_fast_balls = 0;       // шаров, заметённых на последнем подшаге (--ccd)
+int stat_swept_hits = 0;       // из них остановленных у первого касания
+int stat_constraint_colors = 0;    // батчей связей без конфликтного
+int stat_constraint_conflicts = 0; // связей в конфликтном батче
+float stat_constraint_error = 0.0f;    // наибольшее отклонение жёсткой связи или булавки на последнем проходе
+long long total_spawned = 0, total_killed = 0;
+long long total_fast_balls = 0, total_swept_hits = 0;    // то же для --ccd за весь прогон
+float stat_solver_residual = 0.0f; // наибольшее проникновение на последней итерации
+long long stat_solver_iterations_total = 0;
+long long stat_solver_calls = 0;
+
+void record_solver_stats(int iterations, float residual) {
+    stat_solver_iterations = iterations;
+    stat_solver_residual = residual;
+    stat_solver_iterations_total += iterations;
+    stat_solver_calls++;
+}
+
+double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#if PROFILING
+// Трассировка в формате trace event (chrome://tracing, Perfetto). У каждого потока
+// свой буфер; его мьютекс берётся только во время записи, и то без соперников —
+// кроме моментов, когда start_trace/write_trace из другого потока чистят или читают буфер
+struct TraceEvent {
+    const char* name;
+    double start, duration;
+};
+
+struct TraceBuffer {
+    int tid;
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+};
+
+std::atomic<bool> trace_recording{false};
+double trace_origin = 0.0;
+std::mutex trace_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+
+TraceBuffer* this_thread_trace_buffer() {
+    thread_local TraceBuffer* buffer = NULL;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace_buffers.emplace_back(new TraceBuffer());
+        buffer = trace_buffers.back().get();
+        buffer->tid = (int)trace_buffers.size();
+        buffer->events.reserve(1 << 16);
+    }
+    return buffer;
+}
+
+void start_trace() {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    for (auto& buffer : trace_buffers) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        buffer->events.clear();
+    }
+    trace_origin = now_seconds();
+    trace_recording = true;
+}
+
+bool write_trace(const char* path) {
+    trace_recording = false;
+
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        SDL_Log("Failed to write trace: %s", path);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    fprintf(f, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (auto& buffer : trace_buffers) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                first ? "" : ",\n", buffer->tid, buffer->tid == 1 ? "main" : "worker", buffer->tid);
+        first = false;
+        for (const TraceEvent& e : buffer->events) {
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    e.name, buffer->tid, (e.start - trace_origin) * 1e6, e.duration * 1e6);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    SDL_Log("Trace written: %s", path);
+    return true;
+}
+
+// Замер области: фазы копятся в phase_seconds всегда, остальные области
+// трогают часы только пока идёт запись трассы
+struct ProfileScope {
+    const char* name;
+    int phase;
+    double start;
+
+    ProfileScope(const char* name_, int phase_) : name(name_), phase(phase_), start(0.0) {
+        if (phase >= 0 || trace_recording.load(std::memory_order_relaxed))
+            start = now_seconds();
+    }
+
+    ~ProfileScope() {
+        if (start == 0.0)
+            return;
+        double duration = now_seconds() - start;
+        if (phase >= 0)
+            phase_seconds[phase] += duration;
+        if (trace_recording.load(std::memory_order_relaxed)) {
+            TraceBuffer* buffer = this_thread_trace_buffer();
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            buffer->events.push_back({name, start, duration});
+        }
+    }
+};
+
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+#define PROFILE_PHASE(phase) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(PHASE_NAMES[phase], phase)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name, -1)
+#else
+#define PROFILE_PHASE(phase)
+#define PROFILE_SCOPE(name)
+#endif
+
+// Переводит накопленное время фаз в мс за кадр (экспоненциальное сглаживание).
+// Фазы физики до PHASE_SOLVE копит другой поток, их время приходит копией из снимка
+void end_profile_frame(const double* physics_seconds) {
+    static double last_seconds[PHASE_COUNT];
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        double seconds = p <= PHASE_SOLVE ? physics_seconds[p] : phase_seconds[p];
+        float ms = (float)((seconds - last_seconds[p]) * 1000.0);
+        phase_frame_ms[p] += (ms - phase_frame_ms[p]) * 0.1f;
+        last_seconds[p] = seconds;
+    }
+}
+
+// Пул постоянных потоков с кражей работы. Диапазон режется на куски, куски раздаются
+// потокам поровну, освободившийся поток забирает куски с хвоста чужой очереди.
+// Главный поток тоже работает, так что пул из N потоков держит N-1 воркеров
+struct ThreadPool {
+    // младшие 32 бита — первый кусок, старшие — конец, чтобы владелец и вор меняли их одним CAS
+    struct alignas(64) WorkQueue {
+        std::atomic<uint64_t> range{0};
+    };
+
+    int threads = 1;
+    std::vector<std::thread> workers;
+    std::unique_ptr<WorkQueue[]> queues;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<unsigned> generation{0};
+    std::atomic<int> workers_left{0};
+    std::atomic<bool> stopping{false};
+
+    const std::function<void(int, int)>* job = nullptr;
+    int job_begin = 0, job_end = 0, job_grain = 1;
+
+    static uint64_t pack(uint32_t front, uint32_t back) {
+        return ((uint64_t)back << 32) | front;
+    }
+
+    void start(int count) {
+        stop();
+        threads = std::max(1, count);
+        queues.reset(new WorkQueue[threads]);
+        stopping = false;
+        unsigned seen = generation.load();
+        for (int t = 1; t < threads; ++t)
+            workers.emplace_back([this, t, seen] { worker_loop(t, seen); });
+    }
+
+    ~ThreadPool() {
+        stop();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& w : workers)
+            w.join();
+        workers.clear();
+        threads = 1;
+    }
+
+    int pop_front(WorkQueue& q) {
+        uint64_t r = q.range.load(std::memory_order_relaxed);
+        for (;;) {
+            uint32_t front = (uint32_t)r, back = (uint32_t)(r >> 32);
+            if (front >= back)
+                return -1;
+            if (q.range.compare_exchange_weak(r, pack(front + 1, back), std::memory_order_acq_rel))
+                return (int)front;
+        }
+    }
+
+    int steal_back(WorkQueue& q) {
+        uint64_t r = q.range.load(std::memory_order_relaxed);
+        for (;;) {
+            uint32_t front = (uint32_t)r, back = (uint32_t)(r >> 32);
+            if (front >= back)
+                return -1;
+            if (q.range.compare_exchange_weak(r, pack(front, back - 1), std::memory_order_acq_rel))
+                return (int)back - 1;
+        }
+    }
+
+    void run_chunks(int self) {
+        for (;;) {
+            int chunk = pop_front(queues[self]);
+            for (int k = 1; chunk < 0 && k < threads; ++k)
+                chunk = steal_back(queues[(self + k) % threads]);
+            if (chunk < 0)
+                return;
+
+            int begin = job_begin + chunk * job_grain;
+            int end = std::min(job_end, begin + job_grain);
+            PROFILE_SCOPE("chunk");
+            (*job)(begin, end);
+        }
+    }
+
+    void worker_loop(int self, unsigned seen) {
+        for (;;) {
+            // между батчами солвера паузы короткие, поэтому сначала крутимся, потом засыпаем
+            int spins = 0;
+            while (generation.load(std::memory_order_acquire) == seen && spins < 20000) {
+                ++spins;
+                if ((spins & 63) == 0)
+                    std::this_thread::yield();
+            }
+            if (generation.load(std::memory_order_acquire) == seen) {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation.load(std::memory_order_acquire) != seen; });
+            }
+            if (stopping)
+                return;
+
+            seen = generation.load(std::memory_order_acquire);
+            run_chunks(self);
+            workers_left.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    // fn(begin, end) вызывается для кусков по grain элементов. Каждый кусок обрабатывается
+    // ровно одним потоком, так что результат не зависит от того, кто какой кусок украл
+    void parallel_for(int begin, int end, int grain, const std::function<void(int, int)>& fn) {
+        int chunks = (end - begin + grain - 1) / grain;
+        if (threads == 1 || chunks <= 1) {
+            if (begin < end)
+                fn(begin, end);
+            return;
+        }
+
+        job = &fn;
+        job_begin = begin;
+        job_end = end;
+        job_grain = grain;
+        for (int t = 0; t < threads; ++t) {
+            uint32_t first = (uint32_t)((long long)chunks * t / threads);
+            uint32_t last = (uint32_t)((long long)chunks * (t + 1) / threads);
+            queues[t].range.store(pack(first, last), std::memory_order_relaxed);
+        }
+        workers_left.store(threads - 1, std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        wake.notify_all();
+
+        run_chunks(0);
+        // ждём, пока все воркеры отпишутся, иначе следующий вызов перепишет job под ними
+        while (workers_left.load(std::memory_order_acquire) != 0)
+            std::this_thread::yield();
+    }
 };
 
+ThreadPool thread_pool;
+ThreadPool render_pool;  // свой пул у рендера: thread_pool в это время занят физикой
+
+#ifndef HEADLESS
 SDL_Window* window = NULL;
 SDL_Renderer* renderer = NULL;
 TTF_Font* font = NULL;
 
-float dt = 0.0f;
+// Атлас ASCII-глифов: растеризуется один раз при старте, строки HUD собираются
+// из его кусков без TTF_Render*/SDL_CreateTexture в каждом кадре
+const int ATLAS_FIRST_CHAR = 32;
+const int ATLAS_LAST_CHAR = 126;
+
+struct GlyphAtlas {
+    SDL_Texture* texture = NULL;
+    SDL_Rect rects[ATLAS_LAST_CHAR + 1];
+    int advance[ATLAS_LAST_CHAR + 1];
+};
+
+GlyphAtlas glyph_atlas;
+
+// То, что HUD показывает о физике. Копируется в снимок вместе с позициями,
+// чтобы рендер не читал переменные, которые в это время пишет поток физики
+struct HudStats {
+    int broad_phase, pbd_kernel, solver_mode, collision_solver, integrator, boundary, sleeping;
+    int candidates, contacts, contacts_kept, contacts_added, contacts_removed;
+    int solver_iterations;
+    float solver_residual;
+    int static_contacts;
+    int spawned, killed;
+    int continuous_collision, fast_balls, swept_hits;
+    int links, constraint_colors, pins;
+    float constraint_error;
+    int sleeping_balls, islands;
+    int replay_frame, replay_frames;
+    bool replay_paused;
+    long long ticks;                    // тиков с запуска
+    double phase_seconds[PHASE_COUNT];  // заполнены только фазы физики, до PHASE_SOLVE
+};
+
+// Мир на конец тика: поток физики пишет свой слот, рендер читает свой
+struct RenderSnapshot {
+    std::vector<float> tick_x, tick_y;  // начало последнего тика
+    std::vector<float> x, y;            // конец
+    std::vector<float> radius;
+    std::vector<SDL_Color> color;
+    double published = 0.0;             // now_seconds() публикации
+    float tick = 1.0f;
+    HudStats hud = {};
+
+    // шары лежат по тайлам мира построчно: тайл t — [tile_start[t], tile_start[t + 1])
+    float tile_x = 0.0f, tile_y = 0.0f;  // угол тайла 0
+    float tile_size = 1.0f;
+    int tile_cols = 0, tile_rows = 0;
+    std::vector<int> tile_start;
+    float tick_motion = 0.0f;  // сколько шар мог пройти за тик: CCD переключается в потоке физики
+
+    int size() const { return (int)x.size(); }
+};
+
+// Тройной буфер без блокировок: у физики и у рендера по своему слоту, третий — последний
+// опубликованный. Обмен — один exchange; SNAPSHOT_FRESH — рендер этот слот ещё не забирал
+const int SNAPSHOT_FRESH = 4;
+
+struct SnapshotBuffer {
+    RenderSnapshot slots[3];
+    std::atomic<int> ready{1};
+    int back = 0;   // пишет физика
+    int front = 2;  // читает рендер
+
+    RenderSnapshot& write_slot() {
+        return slots[back];
+    }
+
+    void publish() {
+        back = ready.exchange(back | SNAPSHOT_FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    const RenderSnapshot& read() {
+        if (ready.load(std::memory_order_relaxed) & SNAPSHOT_FRESH)
+            front = ready.exchange(front, std::memory_order_acq_rel) & 3;
+        return slots[front];
+    }
+};
+
+SnapshotBuffer snapshots;
+const RenderSnapshot* view = &snapshots.slots[2];  // снимок, который рисует текущий кадр
+
+// Ввод, который меняет мир, не трогает его из потока рендера, а уходит в очередь
+// и применяется потоком физики перед следующим тиком
+enum InputType {
+    INPUT_EXPLOSION,
+    INPUT_ATTRACTOR,
+    INPUT_KEY
+};
+
+struct InputEvent {
+    int type;
+    Vec2 position;
+    SDL_Keycode key;
+};
+
+std::mutex input_mutex;
+std::vector<InputEvent> input_queue;
+#endif
+
+float dt = 0.0f;                  // шаг текущего подшага
+float frame_time = 0.0f;          // реальное время последнего кадра
+float render_alpha = 1.0f;        // доля тика, на которую интерполируем отрисовку
+float physics_rate = 0.0f;        // тиков физики в секунду, для HUD
+long long physics_rate_ticks = 0;
 Uint32 last_frame_time = 0;
 float fps = 0.0f;
 int fps_frames = 0;
@@ -93,31 +946,115 @@ void draw_circle(int cx, int cy, int radius, int segments);
 void draw_border();
 void draw_text(const char* text, int x, int y);
 void draw_text(const char* text, int x, int y, SDL_Color color);
+bool build_glyph_atlas();
 void update_fps();
 void draw();
 void draw_texts();
 void init_balls(int);
+int ball_capacity();
+void update_ball_lifecycle(float tick);
+void kill_ball(BallHandle handle);
 void draw_circle(int cx, int cy, int radius, SDL_Color color);
-void draw_ball(const Ball& b);
-void update_ball(Ball& ball);
+void draw_ball(int i);
+void draw_balls_batched(bool filled);
+void draw_balls_software();
+void release_software_raster();
+void set_integrator(int integrator);
 void update();
-std::vector<BallPair> broad_phase();
-bool test_circle_collision(const Ball& a, const Ball& b);
-std::vector<BallPair> detect_collisions();
+void step();
+void start_physics_thread();
+void stop_physics_thread();
+void post_explosion(Vec2 center);
+void post_attractor(Vec2 center);
+void post_key(SDL_Keycode key);
+void fit_camera();
+Vec2 screen_to_world(Vec2 p);
+void pan_camera(float dx, float dy);
+void zoom_camera(float factor, Vec2 anchor);
+void handle_camera_key(SDL_Keycode key);
+void broad_phase();
+void broad_phase_sweep();
+void broad_phase_grid();
+void collect_contacts();
+void collect_contacts_sweep();
+void collect_contacts_grid();
+std::vector<BallPair>& detect_collisions();
+double mean_contact_index_distance();
 void resolve_collisions_naive_iterative(const std::vector<BallPair>& pairs, int iterations);
 void resolve_collisions_impulse(const std::vector<BallPair>& pairs, int iterations);
 void resolve_collisions_impulse_baumgarte(const std::vector<BallPair>& pairs, int iterations);
-void resolve_collisions_pbd(const std::vector<BallPair>& pairs, int iterations);
-void explode_nearby_balls(Vec2 center, float radius, float strength, std::vector<Ball>& balls);
-
-std::vector<Ball> balls;
-
+void resolve_collisions_pbd(std::vector<BallPair>& pairs, int iterations);
+void build_contact_batches(const std::vector<BallPair>& pairs);
+void resolve_collisions_jacobi(std::vector<BallPair>& pairs, int iterations);
+void warm_start_from_cache(std::vector<BallPair>& pairs);
+void store_contact_cache(const std::vector<BallPair>& pairs);
+void clear_contact_cache();
+bool load_scene(const char* path);
+float collider_distance(const StaticCollider& c, Vec2 p, Vec2& normal);
+float max_displacement();
+void build_fast_grid();
+int sweep_fast_balls();
+bool overlaps_static_geometry(float x, float y, float radius);
+int scene_body_balls();
+void spawn_scene_bodies();
+bool overlaps_scene_body(float x, float y, float radius);
+void reset_constraint_lambdas();
+float solve_ball_constraints(bool parallel, float velocity_scale);
+void remap_ball_constraints();
+void collect_static_contacts();
+float solve_static_contacts(bool reflect_velocity);
+void draw_static_colliders();
+void update_sleep(float tick);
+void mark_island_awake(int ball);
+void wake_marked_islands();
+void wake_all_balls();
+void parse_args(int argc, char* argv[]);
+void run_benchmark();
+void run_solver_suite();
+void scale_world_for_balls(int count, int base_width, int base_height);
+void explode_nearby_balls(Vec2 center, float radius, float strength);
+void add_explosion(Vec2 center, float radius, float strength);
+void add_attractor(Vec2 center, float radius, float strength, float duration);
+void add_wind(Vec2 center, float radius, Vec2 direction, float strength, float duration);
+void apply_force_fields(float tick);
+void reorder_balls_if_due();
+void start_recording(const char* path);
+void record_frame();
+void remap_recording();
+void stop_recording();
+bool open_replay(const char* path);
+bool replaying();
+int replay_frame_index();
+int replay_frame_count();
+bool replay_paused();
+void replay_tick();
+void replay_step(int ticks);
+void replay_toggle_pause();
+void load_replay_balls();
+void close_replay();
+
+BallStorage balls;
+
+#ifdef HEADLESS
 int main(int argc, char* argv[]) {
+    parse_args(argc, argv);
+    if (SUITE_PATH)
+        run_solver_suite();
+    else
+        run_benchmark();
+    thread_pool.stop();
+    return 0;
+}
+#else
+int main(int argc, char* argv[]) {
+    parse_args(argc, argv);
     init();
 
     int running = 1;
     last_frame_time = SDL_GetTicks();
     SDL_Event event;
+    Vec2 gesture_center;
+    bool gesture_active = false;
 
     while (running) {
         while (SDL_PollEvent(&event)) {
@@ -128,38 +1065,518 @@ int main(int argc, char* argv[]) {
                 float fx = event.tfinger.x * SCREEN_WIDTH;
                 float fy = event.tfinger.y * SCREEN_HEIGHT;
                 Vec2 center = {fx, fy};
-                explode_nearby_balls(center, 900.0f, EXPLOSION_STRENGTH, balls);
+                post_explosion(screen_to_world(center));
+            } else if (event.type == SDL_FINGERUP) {
+                gesture_active = false;
+            } else if (event.type == SDL_MULTIGESTURE && event.mgesture.numFingers == 2) {
+                // два пальца: щипок — масштаб, сдвиг центра — панорама
+                Vec2 center(event.mgesture.x * SCREEN_WIDTH, event.mgesture.y * SCREEN_HEIGHT);
+                if (gesture_active)
+                    pan_camera(center.x - gesture_center.x, center.y - gesture_center.y);
+                zoom_camera(1.0f + event.mgesture.dDist * 3.0f, center);
+                gesture_center = center;
+                gesture_active = true;
             } else if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT) {
                 int mx = event.button.x;
                 int my = event.button.y;
                 Vec2 center = {(float)mx, (float)my};
-                explode_nearby_balls(center, 900.0f, EXPLOSION_STRENGTH, balls);
+                post_explosion(screen_to_world(center));
+            } else if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_RIGHT) {
+                Vec2 center = {(float)event.button.x, (float)event.button.y};
+                post_attractor(screen_to_world(center));
+            } else if (event.type == SDL_MOUSEMOTION && (event.motion.state & SDL_BUTTON_MMASK)) {
+                pan_camera((float)event.motion.xrel, (float)event.motion.yrel);
+            } else if (event.type == SDL_MOUSEWHEEL) {
+                int mx, my;
+                SDL_GetMouseState(&mx, &my);
+                zoom_camera(powf(1.25f, (float)event.wheel.y), Vec2((float)mx, (float)my));
             }
             if (event.type == SDL_KEYDOWN) {
                 if (event.key.keysym.sym == SDLK_ESCAPE) {
                     running = false; // или любой твой флаг для выхода из главного цикла
                 }
+                if (event.key.keysym.sym == SDLK_r) {
+                    RENDER_MODE = (RENDER_MODE + 1) % RENDER_MODE_COUNT;
+                }
+                handle_camera_key(event.key.keysym.sym);
+                post_key(event.key.keysym.sym);
+#if PROFILING
+                if (event.key.keysym.sym == SDLK_t) {
+                    if (trace_recording)
+                        write_trace(TRACE_PATH ? TRACE_PATH : "trace.json");
+                    else
+                        start_trace();
+                }
+#endif
             }
         }
 
+        view = &snapshots.read();
         update_fps();
 
+        // рисуем последний тик, протягивая его от начала к концу за время одного тика
+        render_alpha = std::min(1.0f, (float)((now_seconds() - view->published) / view->tick));
+
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
 
-        update();
-        draw();
-        draw_texts();
+        {
+            PROFILE_PHASE(PHASE_DRAW);
+            draw();
+        }
+        {
+            PROFILE_PHASE(PHASE_TEXT);
+            draw_texts();
+        }
 
         SDL_RenderPresent(renderer);
+        end_profile_frame(view->hud.phase_seconds);
         //SDL_Delay(16); // ~60 FPS
     }
 
     cleanup();
     return 0;
 }
+#endif
+
+// "1000,20000,200000" -> {1000, 20000, 200000}
+std::vector<int> parse_int_list(const char* text) {
+    std::vector<int> values;
+    while (*text) {
+        char* end;
+        long value = strtol(text, &end, 10);
+        if (end == text)
+            break;
+        if (value > 0)
+            values.push_back((int)value);
+        text = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+void print_usage(const char* program) {
+    printf("Usage: %s [options]\n"
+           "  --balls N            balls at the start (0 is fine with a scene that spawns them)\n"
+           "  --world WxH | auto   world size, auto grows it to fit the balls\n"
+           "  --scene FILE         static geometry, emitters, kill zones and bodies\n"
+           "  --threads N          physics threads (default: all cores)\n"
+           "  --render-threads N   software rasterizer threads\n"
+           "  --hz N               physics ticks per second\n"
+           "  --substeps N         substeps per tick\n"
+           "  --iterations N       solver iterations per tick (upper bound)\n"
+           "  --tolerance PX       stop iterating below this overlap, 0 runs all\n"
+           "  --solver naive|impulse|baumgarte|pbd\n"
+           "  --integrator verlet|velocity\n"
+           "  --boundary clamp|bounce\n"
+           "  --broad sweep|grid   broad phase\n"
+           "  --warm-start F       share of the previous contact correction\n"
+           "  --sleep 0|1          put settled islands to sleep\n"
+           "  --ccd 0|1            continuous collision for fast balls\n"
+           "  --max-displacement PX  cap on a ball's motion per substep (5, or 120 with --ccd)\n"
+           "  --capacity N         balls to reserve memory for\n"
+           "  --reorder N          Morton reorder every N ticks, 0 disables it\n"
+           "  --record FILE        record ball positions every tick\n"
+           "  --replay FILE        play a recording back (window build)\n"
+           "  --trace FILE         trace output for chrome://tracing\n"
+           "bench only:\n"
+           "  --ticks N            ticks to run\n"
+           "  --seed N             random seed\n"
+           "  --fields N           random small explosions per tick\n"
+           "  --suite FILE.csv     compare the solvers instead of a single run\n"
+           "  --suite-balls LIST   ball counts for --suite, e.g. 1000,10000\n"
+           "  --suite-iterations LIST\n", program);
+}
+
+void parse_args(int argc, char* argv[]) {
+    bool world_auto = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            THREADS_COUNT = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--render-threads") == 0 && i + 1 < argc) {
+            RENDER_THREADS = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+            PHYSICS_HZ = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--substeps") == 0 && i + 1 < argc) {
+            SUBSTEPS = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            RESOLVE_STEPS = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--balls") == 0 && i + 1 < argc) {
+            BALLS_COUNT = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            BENCH_TICKS = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            BENCH_SEED = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--broad") == 0 && i + 1 < argc) {
+            ++i;
+            BROAD_PHASE = strcmp(argv[i], "sweep") == 0 ? BROAD_PHASE_SWEEP : BROAD_PHASE_GRID;
+        } else if (strcmp(argv[i], "--fields") == 0 && i + 1 < argc) {
+            BENCH_FIELDS = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+            REORDER_INTERVAL = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sleep") == 0 && i + 1 < argc) {
+            SLEEPING = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            SOLVER_TOLERANCE = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--solver") == 0 && i + 1 < argc) {
+            ++i;
+            for (int k = 0; k < COLLISION_SOLVER_COUNT; ++k)
+                if (strcmp(argv[i], COLLISION_SOLVER_NAMES[k]) == 0)
+                    COLLISION_SOLVER = k;
+        } else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc) {
+            ++i;
+            INTEGRATOR = strcmp(argv[i], "velocity") == 0 ? INTEGRATOR_VELOCITY : INTEGRATOR_VERLET;
+        } else if (strcmp(argv[i], "--boundary") == 0 && i + 1 < argc) {
+            ++i;
+            BOUNDARY = strcmp(argv[i], "bounce") == 0 ? BOUNDARY_BOUNCE : BOUNDARY_CLAMP;
+        } else if (strcmp(argv[i], "--suite") == 0 && i + 1 < argc) {
+            SUITE_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--suite-balls") == 0 && i + 1 < argc) {
+            SUITE_BALLS = parse_int_list(argv[++i]);
+        } else if (strcmp(argv[i], "--suite-iterations") == 0 && i + 1 < argc) {
+            SUITE_ITERATIONS = parse_int_list(argv[++i]);
+        } else if (strcmp(argv[i], "--warm-start") == 0 && i + 1 < argc) {
+            WARM_START = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            RECORD_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            REPLAY_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            SCENE_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--ccd") == 0 && i + 1 < argc) {
+            CONTINUOUS_COLLISION = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-displacement") == 0 && i + 1 < argc) {
+            // Одна срезка на оба режима: --ccd 0 с той же срезкой показывает, что ловит заметание
+            MAX_DISPLACEMENT = CCD_MAX_DISPLACEMENT = std::max(1.0f, (float)atof(argv[++i]));
+        } else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            BALL_CAPACITY = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--world") == 0 && i + 1 < argc) {
+            ++i;
+            int w, h;
+            if (strcmp(argv[i], "auto") == 0) {
+                world_auto = true;
+            } else if (sscanf(argv[i], "%dx%d", &w, &h) == 2 && w > 0 && h > 0) {
+                WORLD_WIDTH = w;
+                WORLD_HEIGHT = h;
+            } else {
+                SDL_Log("Bad world size: %s, expected WxH or auto", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            TRACE_PATH = argv[++i];
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_usage(argv[0]);
+            exit(0);
+        } else {
+            // опечатка в флаге молча дала бы замер с настройками по умолчанию
+            SDL_Log("Unknown argument or missing value: %s", argv[i]);
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    // --balls может идти и после --world
+    if (world_auto)
+        scale_world_for_balls(BALLS_COUNT, WORLD_WIDTH, WORLD_HEIGHT);
+}
+
+void start_thread_pool() {
+    int threads = THREADS_COUNT > 0 ? THREADS_COUNT : (int)std::thread::hardware_concurrency();
+#ifndef HEADLESS
+    // одно ядро остаётся потоку рендера
+    if (THREADS_COUNT <= 0)
+        threads = std::max(1, threads - 1);
+#endif
+    thread_pool.start(threads);
+}
+
+// Аппаратный счётчик промахов кэша на весь процесс, включая потоки пула, созданные
+// после открытия. Без прав на perf (контейнеры, Android, не Linux) возвращает -1
+int open_cache_miss_counter() {
+#if defined(HEADLESS) && defined(__linux__)
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+void enable_cache_miss_counter(int fd, bool enable) {
+#if defined(HEADLESS) && defined(__linux__)
+    if (fd >= 0) {
+        if (enable)
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+#else
+    (void)fd;
+    (void)enable;
+#endif
+}
+
+long long read_cache_miss_counter(int fd) {
+    long long value = -1;
+#if defined(HEADLESS) && defined(__linux__)
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        value = -1;
+    close(fd);
+#else
+    (void)fd;
+#endif
+    return value;
+}
 
+// Замер физики без окна: фиксированный seed, фиксированный шаг, BENCH_TICKS тиков
+void run_benchmark() {
+    // счётчик открываем до пула, чтобы его потоки унаследовали его
+    int cache_miss_fd = open_cache_miss_counter();
+    start_thread_pool();
+    if (SCENE_PATH && !load_scene(SCENE_PATH))
+        exit(1);
+    srand(BENCH_SEED);
+    init_balls(BALLS_COUNT);
+    if (RECORD_PATH)
+        start_recording(RECORD_PATH);
+
+    for (int p = 0; p < PHASE_COUNT; ++p)
+        phase_seconds[p] = 0.0;
+    stat_solver_iterations_total = stat_solver_calls = 0;
+
+#if PROFILING
+    if (TRACE_PATH)
+        start_trace();
+#endif
+
+    long long field_balls = 0;
+    enable_cache_miss_counter(cache_miss_fd, true);
+    double start = now_seconds();
+    for (int t = 0; t < BENCH_TICKS; ++t) {
+        PROFILE_SCOPE("tick");
+        // маленькие взрывы в случайных точках, как много одновременных касаний
+        for (int f = 0; f < BENCH_FIELDS; ++f) {
+            Vec2 center = {(float)(rand() % WORLD_WIDTH), (float)(rand() % WORLD_HEIGHT)};
+            add_explosion(center, 60.0f, 1.0f);
+        }
+        update();
+        field_balls += stat_field_balls;
+    }
+    double total = now_seconds() - start;
+    enable_cache_miss_counter(cache_miss_fd, false);
+    long long cache_misses = read_cache_miss_counter(cache_miss_fd);
+    stop_recording();
+
+
+#if PROFILING
+    if (TRACE_PATH)
+        write_trace(TRACE_PATH);
+#endif
+
+    const char* solver_names[SOLVER_MODE_COUNT] = {"serial GS", "parallel GS", "jacobi"};
+    printf("balls: %d, ticks: %d x %d substeps, %d Hz, %d iterations/tick\n",
+           BALLS_COUNT, BENCH_TICKS, SUBSTEPS, PHYSICS_HZ, RESOLVE_STEPS);
+    printf("threads: %d, solver: %s%s%s, broad phase: %s, seed: %u\n", thread_pool.threads,
+           COLLISION_SOLVER_NAMES[COLLISION_SOLVER], COLLISION_SOLVER == COLLISION_PBD ? " " : "",
+           COLLISION_SOLVER == COLLISION_PBD ? solver_names[SOLVER_MODE] : "",
+           BROAD_PHASE == BROAD_PHASE_GRID ? "grid" : "sweep", BENCH_SEED);
+    printf("total: %.3f s, %.1f ticks/s, %.1f steps/s\n",
+           total, BENCH_TICKS / total, BENCH_TICKS * SUBSTEPS / total);
+
+    printf("last step: %d candidate pairs, %d contacts (%d kept, %d added, %d removed)\n",
+           stat_candidates, stat_contacts, stat_contacts_kept, stat_contacts_added, stat_contacts_removed);
+    if (SCENE_PATH)
+        printf("scene: %d static colliders, %d static contacts\n", (int)static_colliders.size(), stat_static_contacts);
+    if (!emitters.empty() || !kill_zones.empty())
+        printf("lifecycle: %lld spawned, %lld killed, %d balls at the end (capacity %d)\n",
+               total_spawned, total_killed, balls.size(), balls.capacity());
+    if (COLLISION_SOLVER == COLLISION_PBD)
+        printf("solver: %.2f of %d iterations per step on average, last step %d, residual %.4f px\n",
+               stat_solver_calls ? (double)stat_solver_iterations_total / stat_solver_calls : 0.0,
+               std::max(1, RESOLVE_STEPS / SUBSTEPS), stat_solver_iterations, stat_solver_residual);
+    if (BROAD_PHASE == BROAD_PHASE_SWEEP)
+        printf("sweep: %d swaps to re-sort %d balls\n", stat_sweep_swaps, BALLS_COUNT);
+    if (!distance_constraints.a.empty() || !pins.ball.empty())
+        printf("bodies: %d links in %d colors (%d conflicting), %d pins, max stretch %.4f px\n",
+               (int)distance_constraints.a.size(), stat_constraint_colors,
+               stat_constraint_conflicts,
+               (int)pins.ball.size(), stat_constraint_error);
+    if (CONTINUOUS_COLLISION)
+        printf("ccd: %lld fast balls swept, %lld stopped at first contact (last step %d, %d)\n",
+               total_fast_balls, total_swept_hits, stat_fast_balls, stat_swept_hits);
+    if (SLEEPING)
+        printf("sleeping: %d balls in %d islands\n", stat_sleeping, stat_islands);
+    if (REORDER_INTERVAL > 0)
+        printf("reorder: Morton order every %d ticks\n", REORDER_INTERVAL);
+    else
+        printf("reorder: off\n");
+    printf("locality: mean index distance in a contact %.1f\n", mean_contact_index_distance());
+    if (cache_misses >= 0)
+        printf("cache misses: %.1f per tick\n", (double)cache_misses / BENCH_TICKS);
+    else
+        printf("cache misses: hardware counter unavailable\n");
+    if (BENCH_FIELDS > 0)
+        printf("fields: %d per tick, %.1f balls visited per tick\n", BENCH_FIELDS, (double)field_balls / BENCH_TICKS);
+
+#if PROFILING
+    printf("%-14s %10s %7s\n", "phase", "ms/tick", "%");
+    for (int p = 0; p <= PHASE_SOLVE; ++p)
+        printf("%-14s %10.3f %7.1f\n", PHASE_NAMES[p], phase_seconds[p] * 1000.0 / BENCH_TICKS, 100.0 * phase_seconds[p] / total);
+#else
+    printf("per-phase timings disabled (PROFILING=0)\n");
+#endif
+}
+
+// Мир растёт вместе с числом шаров: стартовая укладка init_balls занимает его целиком,
+// иначе на 100k+ шаров ряды упираются в потолок и рождаются друг в друге
+void scale_world_for_balls(int count, int base_width, int base_height) {
+    int step = MIN_SIZE + MAX_SIZE + 20;
+    double scale = sqrt((double)count * step * step / ((double)base_width * base_height));
+    scale = std::max(1.0, scale);
+    WORLD_WIDTH = (int)(base_width * scale);
+    WORLD_HEIGHT = (int)(base_height * scale);
+}
+
+struct SuiteSample {
+    float max_overlap;
+    double mean_overlap;
+    int contacts;
+    double kinetic;  // на шар, масса 1
+    double energy;   // кинетическая + потенциальная, на шар
+};
+
+// Качество текущего состояния: перекрытия пар последней узкой фазы, пересчитанные по итоговым
+// позициям, энергия по скоростям Верле. Только чтение: свежая детекция перестроила бы broad phase,
+// кэш контактов и порядок sweep, и замер менял бы следующий шаг солвера
+SuiteSample measure_suite_sample() {
+    SuiteSample sample;
+    sample.max_overlap = 0.0f;
+    sample.contacts = 0;
+    double overlap_sum = 0.0;
+    for (const BallPair& pair : contact_pairs) {
+        float dx = balls.x[pair.b] - balls.x[pair.a];
+        float dy = balls.y[pair.b] - balls.y[pair.a];
+        float penetration = balls.radius[pair.a] + balls.radius[pair.b] - sqrtf(dx * dx + dy * dy);
+        if (penetration <= 0.0f)
+            continue;
+        sample.max_overlap = std::max(sample.max_overlap, penetration);
+        overlap_sum += penetration;
+        sample.contacts++;
+    }
+    sample.mean_overlap = sample.contacts ? overlap_sum / sample.contacts : 0.0;
+
+    int n = balls.size();
+    double kinetic = 0.0, potential = 0.0;
+    for (int i = 0; i < n; ++i) {
+        double vx = (balls.x[i] - balls.prev_x[i]) / dt;
+        double vy = (balls.y[i] - balls.prev_y[i]) / dt;
+        kinetic += 0.5 * (vx * vx + vy * vy);
+        potential += GRAVITY * (WORLD_HEIGHT - balls.y[i]);
+    }
+    sample.kinetic = kinetic / n;
+    sample.energy = (kinetic + potential) / n;
+    return sample;
+}
+
+// Высота кучи: 99-й перцентиль верхних точек шаров над полом, одиночные отскоки не в счёт
+float measure_pile_height() {
+    int n = balls.size();
+    std::vector<float> tops(n);
+    for (int i = 0; i < n; ++i)
+        tops[i] = WORLD_HEIGHT - (balls.y[i] - balls.radius[i]);
+    int k = std::min(n - 1, (int)(0.99 * n));
+    std::nth_element(tops.begin(), tops.begin() + k, tops.end());
+    return tops[k];
+}
+
+// Все солверы на всех сочетаниях SUITE_BALLS x SUITE_ITERATIONS, по BENCH_TICKS тиков
+// с одним seed. Время — только update(); качество — за последнюю секунду прогона,
+// когда куча уже должна лежать. Сон выключен, чтобы он не прятал дрожь солвера
+void run_solver_suite() {
+    FILE* csv = fopen(SUITE_PATH, "w");
+    if (!csv) {
+        SDL_Log("Cannot open %s", SUITE_PATH);
+        exit(1);
+    }
+    fprintf(csv, "solver,balls,iterations,world_width,world_height,ticks,substeps,threads,"
+                 "ms_per_tick,ms_per_step,contacts,max_overlap,mean_overlap,"
+                 "kinetic_energy,kinetic_drift,energy_drift,pile_height\n");
+
+    start_thread_pool();
+    int base_width = WORLD_WIDTH;
+    int base_height = WORLD_HEIGHT;
+    int sleeping = SLEEPING;
+    int solver = COLLISION_SOLVER;
+    int iterations = RESOLVE_STEPS;
+    SLEEPING = 0;
+
+    // последняя секунда, но не больше половины прогона
+    int window = std::max(1, std::min(PHYSICS_HZ, BENCH_TICKS / 2));
+    for (int count : SUITE_BALLS) {
+        for (int s = 0; s < COLLISION_SOLVER_COUNT; ++s) {
+            for (int steps : SUITE_ITERATIONS) {
+                COLLISION_SOLVER = s;
+                RESOLVE_STEPS = steps;
+                BALLS_COUNT = count;
+                scale_world_for_balls(count, base_width, base_height);
+                srand(BENCH_SEED);
+                init_balls(count);
+
+                double busy = 0.0;
+                float max_overlap = 0.0f;
+                double mean_overlap = 0.0;
+                int contacts = 0;
+                SuiteSample first = {}, last = {};
+                for (int t = 0; t < BENCH_TICKS; ++t) {
+                    double start = now_seconds();
+                    update();
+                    busy += now_seconds() - start;
+
+                    if (t < BENCH_TICKS - window)
+                        continue;
+                    last = measure_suite_sample();
+                    if (t == BENCH_TICKS - window)
+                        first = last;
+                    max_overlap = std::max(max_overlap, last.max_overlap);
+                    mean_overlap += last.mean_overlap / window;
+                    contacts = last.contacts;
+                }
+                float pile_height = measure_pile_height();
+
+                double ms_per_tick = busy * 1000.0 / BENCH_TICKS;
+                fprintf(csv, "%s,%d,%d,%d,%d,%d,%d,%d,%.4f,%.4f,%d,%.4f,%.4f,%.2f,%.2f,%.2f,%.1f\n",
+                        COLLISION_SOLVER_NAMES[s], count, steps, WORLD_WIDTH, WORLD_HEIGHT, BENCH_TICKS, SUBSTEPS,
+                        thread_pool.threads, ms_per_tick, ms_per_tick / SUBSTEPS, contacts, max_overlap, mean_overlap,
+                        last.kinetic, last.kinetic - first.kinetic, last.energy - first.energy, pile_height);
+                fflush(csv);
+                printf("%-9s %7d balls %3d iterations: %8.3f ms/tick, overlap max %.3f mean %.3f px, pile %.0f px\n",
+                       COLLISION_SOLVER_NAMES[s], count, steps, ms_per_tick, max_overlap, mean_overlap, pile_height);
+                fflush(stdout);
+            }
+        }
+    }
+    fclose(csv);
+
+    SLEEPING = sleeping;
+    COLLISION_SOLVER = solver;
+    RESOLVE_STEPS = iterations;
+    WORLD_WIDTH = base_width;
+    WORLD_HEIGHT = base_height;
+}
+
+#ifndef HEADLESS
 void init() {
+    start_thread_pool();
+
+    // размер окна и шары берутся из записи
+    if (REPLAY_PATH && !open_replay(REPLAY_PATH))
+        exit(1);
+    if (SCENE_PATH && !load_scene(SCENE_PATH))
+        exit(1);
+
     SDL_Init(SDL_INIT_VIDEO);
     if (TTF_Init() != 0) {
         SDL_Log("TTF_Init failed: %s", TTF_GetError());
@@ -184,12 +1601,31 @@ void init() {
 
     renderer = SDL_CreateRenderer(window, -1, 0);
 
+    if (!build_glyph_atlas())
+        SDL_Log("Glyph atlas unavailable, text is rendered per frame: %s", SDL_GetError());
+
 fps_start_time = SDL_GetTicks();
     fps_frames = 0;
-    init_balls(BALLS_COUNT);
+    if (replaying()) {
+        load_replay_balls();
+    } else {
+        init_balls(BALLS_COUNT);
+        if (RECORD_PATH)
+            start_recording(RECORD_PATH);
+    }
+    fit_camera();
+    start_physics_thread();
 }
 
 void cleanup() {
+    stop_physics_thread();
+    thread_pool.stop();
+    stop_recording();
+    close_replay();
+
+    render_pool.stop();
+    release_software_raster();
+    if (glyph_atlas.texture) SDL_DestroyTexture(glyph_atlas.texture);
     if (font) TTF_CloseFont(font);
     TTF_Quit();
 
@@ -217,75 +1653,874 @@ void draw_circle(int cx, int cy, int radius, SDL_Color color) {
     }
 }
 
-void draw_ball(const Ball& b) {
-    //SDL_Color color = b.colliding ? SDL_Color{255,255,255,255} : SDL_Color{200,200,200,255};
-    draw_circle((int)b.pos.x, (int)b.pos.y, b.radius,b.color);
+// Камера: мировая точка в центре окна и масштаб (пикселей окна на единицу мира).
+// Живёт только в потоке рендера
+struct Camera {
+    float x, y;
+    float zoom;
+};
+
+Camera camera;
+
+float camera_fit_zoom() {
+    return std::min((float)SCREEN_WIDTH / WORLD_WIDTH, (float)SCREEN_HEIGHT / WORLD_HEIGHT);
 }
 
-void draw_border() {
-    int w = SCREEN_WIDTH - 1;
-    int h = SCREEN_HEIGHT - 1;
+// Весь мир в окне; при мире размером с окно — тождественное отображение, как раньше
+void fit_camera() {
+    camera.zoom = camera_fit_zoom();
+    camera.x = WORLD_WIDTH * 0.5f;
+    camera.y = WORLD_HEIGHT * 0.5f;
+}
 
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-    SDL_RenderDrawLine(renderer, 0, 0, w - 1, 0);
-    SDL_RenderDrawLine(renderer, 0, 0, 0, h - 1);
-    SDL_RenderDrawLine(renderer, 0, h, w, h);
-    SDL_RenderDrawLine(renderer, w, 0, w, h);
+Vec2 world_to_screen(Vec2 p) {
+    return Vec2((p.x - camera.x) * camera.zoom + SCREEN_WIDTH * 0.5f,
+                (p.y - camera.y) * camera.zoom + SCREEN_HEIGHT * 0.5f);
 }
 
-void draw_text(const char* text, int x, int y) {
-    SDL_Color color = {255, 255, 255, 255};
-    draw_text(text, x, y, color);
+Vec2 screen_to_world(Vec2 p) {
+    return Vec2((p.x - SCREEN_WIDTH * 0.5f) / camera.zoom + camera.x,
+                (p.y - SCREEN_HEIGHT * 0.5f) / camera.zoom + camera.y);
 }
 
-void draw_text(const char* text, int x, int y, SDL_Color color) {
-    
-    SDL_Surface* surface = TTF_RenderText_Blended(font, text, color);
-    if (!surface)
-        return;
+// Масштаб вокруг точки окна: мировая точка под курсором остаётся на месте
+void zoom_camera(float factor, Vec2 anchor) {
+    Vec2 before = screen_to_world(anchor);
+    camera.zoom = std::min(std::max(camera.zoom * factor, camera_fit_zoom() * 0.5f), 20.0f);
+    Vec2 after = screen_to_world(anchor);
+    camera.x += before.x - after.x;
+    camera.y += before.y - after.y;
+}
 
-    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
-    SDL_Rect dst = {x, y, surface->w, surface->h};
-    SDL_RenderCopy(renderer, texture, NULL, &dst);
+void pan_camera(float dx, float dy) {
+    camera.x -= dx / camera.zoom;
+    camera.y -= dy / camera.zoom;
+}
 
-    SDL_FreeSurface(surface);
-    SDL_DestroyTexture(texture);
+// Стрелки двигают камеру на десятую окна (влево/вправо — только вне воспроизведения,
+// там они перематывают), +/- масштабируют вокруг центра, Home показывает весь мир
+void handle_camera_key(SDL_Keycode key) {
+    float step_x = SCREEN_WIDTH * 0.1f;
+    float step_y = SCREEN_HEIGHT * 0.1f;
+    Vec2 center(SCREEN_WIDTH * 0.5f, SCREEN_HEIGHT * 0.5f);
+    if (key == SDLK_UP)
+        pan_camera(0.0f, step_y);
+    else if (key == SDLK_DOWN)
+        pan_camera(0.0f, -step_y);
+    else if (key == SDLK_LEFT && !replaying())
+        pan_camera(step_x, 0.0f);
+    else if (key == SDLK_RIGHT && !replaying())
+        pan_camera(-step_x, 0.0f);
+    else if (key == SDLK_EQUALS || key == SDLK_PLUS || key == SDLK_KP_PLUS)
+        zoom_camera(1.25f, center);
+    else if (key == SDLK_MINUS || key == SDLK_KP_MINUS)
+        zoom_camera(0.8f, center);
+    else if (key == SDLK_HOME)
+        fit_camera();
 }
 
-void update_fps() {
-    fps_frames++;
-    Uint32 now = SDL_GetTicks();
+// Видимые шары снимка: по диапазону на строку тайлов, шары внутри строки лежат подряд
+std::vector<std::pair<int, int>> visible_ranges;
+int stat_visible = 0;
 
-    if (now - fps_start_time >= 1000) {
-        fps = fps_frames * 1000.0f / (now - fps_start_time);
-        fps_frames = 0;
-        fps_start_time = now;
+void collect_visible_ranges() {
+    visible_ranges.clear();
+    stat_visible = 0;
+    if (view->size() == 0)
+        return;
+
+    // шар сортирован по концу тика, а рисуется между началом и концом; плюс радиус
+    float pad = 2.0f * (MIN_SIZE + MAX_SIZE) + view->tick_motion;
+    Vec2 lo = screen_to_world(Vec2(0.0f, 0.0f));
+    Vec2 hi = screen_to_world(Vec2((float)SCREEN_WIDTH, (float)SCREEN_HEIGHT));
+    float inv_tile = 1.0f / view->tile_size;
+    int c0 = std::max(0, (int)floorf((lo.x - pad - view->tile_x) * inv_tile));
+    int c1 = std::min(view->tile_cols - 1, (int)floorf((hi.x + pad - view->tile_x) * inv_tile));
+    int r0 = std::max(0, (int)floorf((lo.y - pad - view->tile_y) * inv_tile));
+    int r1 = std::min(view->tile_rows - 1, (int)floorf((hi.y + pad - view->tile_y) * inv_tile));
+
+    for (int r = r0; r <= r1 && c0 <= c1; ++r) {
+        int begin = view->tile_start[r * view->tile_cols + c0];
+        int end = view->tile_start[r * view->tile_cols + c1 + 1];
+        if (begin < end) {
+            visible_ranges.push_back(std::make_pair(begin, end));
+            stat_visible += end - begin;
+        }
+    }
+}
+
+// между тиками рисуем промежуточное положение, иначе при 60 Гц физики движение дёргается
+Vec2 ball_render_pos(int i) {
+    return world_to_screen(Vec2(view->tick_x[i] + (view->x[i] - view->tick_x[i]) * render_alpha,
+                                view->tick_y[i] + (view->y[i] - view->tick_y[i]) * render_alpha));
+}
+
+// Шар мельче LOD_POINT_RADIUS пикселей рисуется точкой, а не окружностью
+const float LOD_POINT_RADIUS = 1.5f;
+
+void draw_ball(int i) {
+    //SDL_Color color = balls.colliding[i] ? SDL_Color{255,255,255,255} : SDL_Color{200,200,200,255};
+    Vec2 p = ball_render_pos(i);
+    float r = view->radius[i] * camera.zoom;
+    if (r < LOD_POINT_RADIUS) {
+        SDL_Color color = view->color[i];
+        SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
+        SDL_RenderDrawPoint(renderer, (int)p.x, (int)p.y);
+        return;
+    }
+    draw_circle((int)p.x, (int)p.y, (int)r, view->color[i]);
+}
+
+// Единичные окружности по числу сегментов: cosf/sinf считаются один раз, а не на каждый шар
+std::vector<std::vector<SDL_FPoint>> unit_circles;
+
+const std::vector<SDL_FPoint>& unit_circle(int segments) {
+    if ((int)unit_circles.size() <= segments)
+        unit_circles.resize(segments + 1);
+
+    std::vector<SDL_FPoint>& circle = unit_circles[segments];
+    if (circle.empty()) {
+        float angle_step = 2.0f * M_PI / segments;
+        for (int i = 0; i <= segments; ++i)
+            circle.push_back({cosf(i * angle_step), sinf(i * angle_step)});
+    }
+    return circle;
+}
+
+// при сильном приближении сегментов не больше этого
+const int MAX_CIRCLE_SEGMENTS = 64;
+
+// Буферы геометрии переживают кадр, чтобы не аллоцировать их заново
+std::vector<SDL_Vertex> circle_vertices;
+std::vector<int> circle_indices;
+std::vector<SDL_Point> circle_points;
+// SDL_RenderGeometry однажды отказал — больше не пробуем
+bool render_geometry_failed = false;
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+// Все видимые шары одной геометрией: диск — веер треугольников от центра,
+// контур — кольцо толщиной в пиксель из пар треугольников на сегмент,
+// мелкий шар — квадрат-спрайт из двух треугольников. false — драйвер не принял геометрию
+bool draw_balls_geometry(bool filled) {
+    circle_vertices.clear();
+    circle_indices.clear();
+
+    for (const std::pair<int, int>& range : visible_ranges) {
+        for (int i = range.first; i < range.second; ++i) {
+            Vec2 p = ball_render_pos(i);
+            float r = view->radius[i] * camera.zoom;
+            SDL_Color color = view->color[i];
+            int base = (int)circle_vertices.size();
+
+            if (r < LOD_POINT_RADIUS) {
+                float h = std::max(0.5f, r);
+                circle_vertices.push_back({{p.x - h, p.y - h}, color, {0, 0}});
+                circle_vertices.push_back({{p.x + h, p.y - h}, color, {0, 0}});
+                circle_vertices.push_back({{p.x + h, p.y + h}, color, {0, 0}});
+                circle_vertices.push_back({{p.x - h, p.y + h}, color, {0, 0}});
+                int quad[6] = {0, 1, 2, 0, 2, 3};
+                for (int k = 0; k < 6; ++k)
+                    circle_indices.push_back(base + quad[k]);
+                continue;
+            }
+
+            int segments = std::min(MAX_CIRCLE_SEGMENTS, std::max(6, (int)r));
+            const std::vector<SDL_FPoint>& circle = unit_circle(segments);
+
+            if (filled) {
+                circle_vertices.push_back({{p.x, p.y}, color, {0, 0}});
+                for (int k = 0; k < segments; ++k)
+                    circle_vertices.push_back({{p.x + circle[k].x * r, p.y + circle[k].y * r}, color, {0, 0}});
+                for (int k = 0; k < segments; ++k) {
+                    circle_indices.push_back(base);
+                    circle_indices.push_back(base + 1 + k);
+                    circle_indices.push_back(base + 1 + (k + 1) % segments);
+                }
+            } else {
+                float inner = r - 0.5f;
+                float outer = r + 0.5f;
+                for (int k = 0; k < segments; ++k) {
+                    circle_vertices.push_back({{p.x + circle[k].x * inner, p.y + circle[k].y * inner}, color, {0, 0}});
+                    circle_vertices.push_back({{p.x + circle[k].x * outer, p.y + circle[k].y * outer}, color, {0, 0}});
+                }
+                for (int k = 0; k < segments; ++k) {
+                    int i0 = base + 2 * k;
+                    int i1 = base + 2 * ((k + 1) % segments);
+                    circle_indices.push_back(i0);
+                    circle_indices.push_back(i0 + 1);
+                    circle_indices.push_back(i1 + 1);
+                    circle_indices.push_back(i0);
+                    circle_indices.push_back(i1 + 1);
+                    circle_indices.push_back(i1);
+                }
+            }
+        }
+    }
+
+    if (circle_vertices.empty())
+        return true;
+    return SDL_RenderGeometry(renderer, NULL, circle_vertices.data(), (int)circle_vertices.size(),
+                              circle_indices.data(), (int)circle_indices.size()) == 0;
+}
+#endif
+
+void draw_balls_batched(bool filled) {
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    if (!render_geometry_failed) {
+        if (draw_balls_geometry(filled))
+            return;
+        // контурный режим тоже идёт через SDL_RenderGeometry, поэтому уходим на линии
+        SDL_Log("SDL_RenderGeometry failed: %s, falling back to line strips", SDL_GetError());
+        render_geometry_failed = true;
+        RENDER_MODE = RENDER_LINES;
+    }
+#endif
+
+    // Без SDL_RenderGeometry: один SDL_RenderDrawLines на шар вместо вызова на сегмент
+    for (const std::pair<int, int>& range : visible_ranges) {
+        for (int i = range.first; i < range.second; ++i) {
+            Vec2 p = ball_render_pos(i);
+            float r = view->radius[i] * camera.zoom;
+            SDL_Color color = view->color[i];
+            SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
+            if (r < LOD_POINT_RADIUS) {
+                SDL_RenderDrawPoint(renderer, (int)p.x, (int)p.y);
+                continue;
+            }
+
+            int segments = std::min(MAX_CIRCLE_SEGMENTS, std::max(6, (int)r));
+            const std::vector<SDL_FPoint>& circle = unit_circle(segments);
+            circle_points.resize(segments + 1);
+            for (int k = 0; k <= segments; ++k)
+                circle_points[k] = {(int)(p.x + circle[k].x * r), (int)(p.y + circle[k].y * r)};
+            SDL_RenderDrawLines(renderer, circle_points.data(), segments + 1);
+        }
+    }
+}
+
+// Программный растеризатор: видимые шары раскладываются по тайлам экрана, каждый тайл
+// целиком (очистка и все его диски по порядку снимка) рисует один поток render_pool
+// в общий кадр в памяти, кадр уходит в потоковую текстуру одним SDL_UpdateTexture.
+// Стоимость растёт с площадью дисков и делится между ядрами, а не с числом вызовов драйвера
+const int RASTER_TILE = 64;
+const Uint32 RASTER_BACKGROUND = 0xff000000;
+
+struct SoftwareRaster {
+    SDL_Texture* texture = NULL;
+    bool pool_started = false;
+    int width = 0, height = 0;
+    int tiles_x = 0, tiles_y = 0;
+    std::vector<Uint32> pixels;     // ARGB8888, width * height
+    std::vector<float> x, y, r;     // видимые шары в пикселях экрана
+    std::vector<Uint32> color;
+    std::vector<int> tile_start;    // шары тайла t — tile_balls[tile_start[t]..tile_start[t + 1])
+    std::vector<int> tile_balls;
+};
+
+SoftwareRaster software_raster;
+
+inline Uint32 pack_argb(SDL_Color c) {
+    return 0xff000000u | ((Uint32)c.r << 16) | ((Uint32)c.g << 8) | c.b;
+}
+
+// a — покрытие 0..256; красный и синий смешиваются одним умножением
+inline Uint32 blend_argb(Uint32 dst, Uint32 src, Uint32 a) {
+    Uint32 rb = ((src & 0xff00ff) * a + (dst & 0xff00ff) * (256 - a)) >> 8;
+    Uint32 g = ((src & 0x00ff00) * a + (dst & 0x00ff00) * (256 - a)) >> 8;
+    return 0xff000000u | (rb & 0xff00ff) | (g & 0x00ff00);
+}
+
+inline void fill_span(Uint32* p, int count, Uint32 color) {
+#if defined(__SSE2__)
+    __m128i c = _mm_set1_epi32((int)color);
+    for (; count >= 4; count -= 4, p += 4)
+        _mm_storeu_si128((__m128i*)p, c);
+#endif
+    for (; count > 0; --count)
+        *p++ = color;
+}
+
+// Диск с краем в пиксель: покрытие пикселя = r + 0.5 - расстояние до центра, обрезанное
+// в [0, 1]. Середина строки (покрытие 1) заливается сплошным отрезком, смешиваются только края
+void raster_disc(Uint32* pixels, int pitch, float cx, float cy, float r, Uint32 color,
+                 int x0, int y0, int x1, int y1) {
+    float outer = r + 0.5f;
+    float inner = r - 0.5f;
+    int ya = std::max(y0, (int)floorf(cy - outer));
+    int yb = std::min(y1, (int)ceilf(cy + outer));
+
+    for (int y = ya; y < yb; ++y) {
+        float dy = y + 0.5f - cy;
+        float o2 = outer * outer - dy * dy;
+        if (o2 <= 0.0f)
+            continue;
+        float ow = sqrtf(o2);
+        int xa = std::max(x0, (int)floorf(cx - ow));
+        int xb = std::min(x1, (int)ceilf(cx + ow));
+        if (xa >= xb)
+            continue;
+
+        int ia = xb, ib = xb;
+        float i2 = inner * inner - dy * dy;
+        if (inner > 0.0f && i2 > 0.0f) {
+            float iw = sqrtf(i2);
+            ia = std::min(xb, std::max(xa, (int)ceilf(cx - iw - 0.5f)));
+            ib = std::min(xb, std::max(ia, (int)floorf(cx + iw - 0.5f) + 1));
+        }
+
+        Uint32* row = pixels + y * pitch;
+        for (int x = xa; x < xb; ++x) {
+            if (x == ia && ib > ia) {
+                fill_span(row + ia, ib - ia, color);
+                x = ib - 1;
+                continue;
+            }
+            float dx = x + 0.5f - cx;
+            float coverage = outer - sqrtf(dx * dx + dy * dy);
+            if (coverage <= 0.0f)
+                continue;
+            Uint32 a = coverage >= 1.0f ? 256 : (Uint32)(coverage * 256.0f);
+            row[x] = blend_argb(row[x], color, a);
+        }
+    }
+}
+
+void raster_tile(int tile) {
+    SoftwareRaster& raster = software_raster;
+    int x0 = (tile % raster.tiles_x) * RASTER_TILE;
+    int y0 = (tile / raster.tiles_x) * RASTER_TILE;
+    int x1 = std::min(raster.width, x0 + RASTER_TILE);
+    int y1 = std::min(raster.height, y0 + RASTER_TILE);
+    Uint32* pixels = raster.pixels.data();
+
+    for (int y = y0; y < y1; ++y)
+        fill_span(pixels + y * raster.width + x0, x1 - x0, RASTER_BACKGROUND);
+
+    for (int k = raster.tile_start[tile]; k < raster.tile_start[tile + 1]; ++k) {
+        int i = raster.tile_balls[k];
+        raster_disc(pixels, raster.width, raster.x[i], raster.y[i], raster.r[i], raster.color[i], x0, y0, x1, y1);
+    }
+}
+
+// диапазон тайлов, которые задевает шар i
+inline void raster_ball_tiles(int i, int& tx0, int& ty0, int& tx1, int& ty1) {
+    const SoftwareRaster& raster = software_raster;
+    float reach = raster.r[i] + 0.5f;
+    tx0 = std::max(0, (int)floorf(raster.x[i] - reach) / RASTER_TILE);
+    ty0 = std::max(0, (int)floorf(raster.y[i] - reach) / RASTER_TILE);
+    tx1 = std::min(raster.tiles_x - 1, (int)ceilf(raster.x[i] + reach) / RASTER_TILE);
+    ty1 = std::min(raster.tiles_y - 1, (int)ceilf(raster.y[i] + reach) / RASTER_TILE);
+}
+
+void draw_balls_software() {
+    SoftwareRaster& raster = software_raster;
+    if (!raster.pool_started) {
+        int threads = RENDER_THREADS > 0 ? RENDER_THREADS : (int)std::thread::hardware_concurrency() / 2;
+        render_pool.start(std::max(1, threads));
+        raster.pool_started = true;
+    }
+    if (!raster.texture || raster.width != SCREEN_WIDTH || raster.height != SCREEN_HEIGHT) {
+        if (raster.texture)
+            SDL_DestroyTexture(raster.texture);
+        raster.width = SCREEN_WIDTH;
+        raster.height = SCREEN_HEIGHT;
+        raster.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                           raster.width, raster.height);
+        if (!raster.texture) {
+            SDL_Log("Streaming texture unavailable, falling back to batched rendering: %s", SDL_GetError());
+            RENDER_MODE = RENDER_BATCHED_FILLED;
+            return;
+        }
+        raster.pixels.assign((size_t)raster.width * raster.height, RASTER_BACKGROUND);
+        raster.tiles_x = (raster.width + RASTER_TILE - 1) / RASTER_TILE;
+        raster.tiles_y = (raster.height + RASTER_TILE - 1) / RASTER_TILE;
+    }
+
+    // видимые шары в координатах экрана
+    raster.x.clear();
+    raster.y.clear();
+    raster.r.clear();
+    raster.color.clear();
+    for (const std::pair<int, int>& range : visible_ranges) {
+        for (int i = range.first; i < range.second; ++i) {
+            Vec2 p = ball_render_pos(i);
+            float r = std::max(0.5f, view->radius[i] * camera.zoom);
+            if (p.x + r < 0.0f || p.y + r < 0.0f || p.x - r > raster.width || p.y - r > raster.height)
+                continue;
+            raster.x.push_back(p.x);
+            raster.y.push_back(p.y);
+            raster.r.push_back(r);
+            raster.color.push_back(pack_argb(view->color[i]));
+        }
+    }
+
+    // counting sort по тайлам; шар на границе попадает в несколько тайлов
+    int tiles = raster.tiles_x * raster.tiles_y;
+    int n = (int)raster.x.size();
+    raster.tile_start.assign(tiles + 1, 0);
+    int tx0, ty0, tx1, ty1;
+    for (int i = 0; i < n; ++i) {
+        raster_ball_tiles(i, tx0, ty0, tx1, ty1);
+        for (int ty = ty0; ty <= ty1; ++ty)
+            for (int tx = tx0; tx <= tx1; ++tx)
+                raster.tile_start[ty * raster.tiles_x + tx + 1]++;
+    }
+    for (int t = 0; t < tiles; ++t)
+        raster.tile_start[t + 1] += raster.tile_start[t];
+    raster.tile_balls.resize(raster.tile_start[tiles]);
+    for (int i = 0; i < n; ++i) {
+        raster_ball_tiles(i, tx0, ty0, tx1, ty1);
+        for (int ty = ty0; ty <= ty1; ++ty)
+            for (int tx = tx0; tx <= tx1; ++tx)
+                raster.tile_balls[raster.tile_start[ty * raster.tiles_x + tx]++] = i;
+    }
+    for (int t = tiles; t > 0; --t)
+        raster.tile_start[t] = raster.tile_start[t - 1];
+    raster.tile_start[0] = 0;
+
+    render_pool.parallel_for(0, tiles, 1, [](int begin, int end) {
+        for (int t = begin; t < end; ++t)
+            raster_tile(t);
+    });
+
+    SDL_UpdateTexture(raster.texture, NULL, raster.pixels.data(), raster.width * (int)sizeof(Uint32));
+    SDL_RenderCopy(renderer, raster.texture, NULL, NULL);
+}
+
+void release_software_raster() {
+    if (software_raster.texture)
+        SDL_DestroyTexture(software_raster.texture);
+    software_raster.texture = NULL;
+}
+
+// Граница мира в координатах окна
+void draw_border() {
+    Vec2 lo = world_to_screen(Vec2(0.0f, 0.0f));
+    Vec2 hi = world_to_screen(Vec2((float)WORLD_WIDTH, (float)WORLD_HEIGHT));
+    int x0 = (int)lo.x, y0 = (int)lo.y;
+    int x1 = (int)hi.x - 1, y1 = (int)hi.y - 1;
+
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderDrawLine(renderer, x0, y0, x1 - 1, y0);
+    SDL_RenderDrawLine(renderer, x0, y0, x0, y1 - 1);
+    SDL_RenderDrawLine(renderer, x0, y1, x1, y1);
+    SDL_RenderDrawLine(renderer, x1, y0, x1, y1);
+}
+
+// Статическая геометрия: серые контуры, только то, что попадает в окно
+void draw_static_colliders() {
+    // зоны удаления — красные рамки, эмиттеры — зелёная черта по направлению выброса.
+    // Их положение после загрузки сцены не меняется, поток физики трогает только счётчики
+    SDL_SetRenderDrawColor(renderer, 200, 60, 60, 255);
+    for (const KillZone& z : kill_zones) {
+        Vec2 lo = world_to_screen(Vec2(z.min_x, z.min_y));
+        Vec2 hi = world_to_screen(Vec2(z.max_x, z.max_y));
+        SDL_Rect rect = {(int)lo.x, (int)lo.y, (int)(hi.x - lo.x), (int)(hi.y - lo.y)};
+        SDL_RenderDrawRect(renderer, &rect);
+    }
+    SDL_SetRenderDrawColor(renderer, 60, 200, 60, 255);
+    for (const Emitter& e : emitters) {
+        Vec2 a = world_to_screen(e.pos);
+        Vec2 b = world_to_screen(Vec2(e.pos.x + e.velocity.x * 0.1f, e.pos.y + e.velocity.y * 0.1f));
+        SDL_RenderDrawLine(renderer, (int)a.x, (int)a.y, (int)b.x, (int)b.y);
+    }
+
+    if (bvh_nodes.empty())
+        return;
+    Vec2 lo = screen_to_world(Vec2(0.0f, 0.0f));
+    Vec2 hi = screen_to_world(Vec2((float)SCREEN_WIDTH, (float)SCREEN_HEIGHT));
+
+    SDL_SetRenderDrawColor(renderer, 160, 160, 160, 255);
+    std::vector<SDL_Point> points;
+    query_bvh(lo.x, lo.y, hi.x, hi.y, [&points](int i) {
+        const StaticCollider& c = static_colliders[i];
+        points.clear();
+        for (int k = 0; k <= c.count; ++k) {
+            if (k == c.count && c.shape == COLLIDER_SEGMENT)
+                break;
+            Vec2 p = world_to_screen(static_vertices[c.first + k % c.count]);
+            points.push_back(SDL_Point{(int)p.x, (int)p.y});
+        }
+        SDL_RenderDrawLines(renderer, points.data(), (int)points.size());
+    });
+}
+
+void draw_text(const char* text, int x, int y) {
+    SDL_Color color = {255, 255, 255, 255};
+    draw_text(text, x, y, color);
+}
+
+bool build_glyph_atlas() {
+    // глифы рендерятся белыми, цвет строки задаётся через color mod текстуры
+    SDL_Color white = {255, 255, 255, 255};
+    SDL_Surface* glyphs[ATLAS_LAST_CHAR + 1] = {NULL};
+
+    int width = 0, height = 0;
+    for (int c = ATLAS_FIRST_CHAR; c <= ATLAS_LAST_CHAR; ++c) {
+        int advance = 0;
+        if (TTF_GlyphMetrics(font, (Uint16)c, NULL, NULL, NULL, NULL, &advance) != 0)
+            advance = 0;
+        glyph_atlas.advance[c] = advance;
+
+        glyphs[c] = TTF_RenderGlyph_Blended(font, (Uint16)c, white);
+        if (glyphs[c]) {
+            width += glyphs[c]->w + 1;
+            height = std::max(height, glyphs[c]->h);
+        }
+    }
+
+    bool ok = false;
+    SDL_Surface* atlas = width > 0 ? SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA32) : NULL;
+    if (atlas) {
+        int x = 0;
+        for (int c = ATLAS_FIRST_CHAR; c <= ATLAS_LAST_CHAR; ++c) {
+            SDL_Rect rect = {x, 0, 0, 0};
+            if (glyphs[c]) {
+                rect.w = glyphs[c]->w;
+                rect.h = glyphs[c]->h;
+                SDL_SetSurfaceBlendMode(glyphs[c], SDL_BLENDMODE_NONE);
+                SDL_BlitSurface(glyphs[c], NULL, atlas, &rect);
+                x += rect.w + 1;
+            }
+            glyph_atlas.rects[c] = rect;
+        }
+
+        glyph_atlas.texture = SDL_CreateTextureFromSurface(renderer, atlas);
+        if (glyph_atlas.texture) {
+            SDL_SetTextureBlendMode(glyph_atlas.texture, SDL_BLENDMODE_BLEND);
+            ok = true;
+        }
+        SDL_FreeSurface(atlas);
+    }
+
+    for (int c = ATLAS_FIRST_CHAR; c <= ATLAS_LAST_CHAR; ++c)
+        if (glyphs[c])
+            SDL_FreeSurface(glyphs[c]);
+    return ok;
+}
+
+void draw_text(const char* text, int x, int y, SDL_Color color) {
+    if (glyph_atlas.texture) {
+        SDL_SetTextureColorMod(glyph_atlas.texture, color.r, color.g, color.b);
+        SDL_SetTextureAlphaMod(glyph_atlas.texture, color.a);
+
+        int pen_x = x;
+        for (const char* p = text; *p; ++p) {
+            int c = (unsigned char)*p;
+            if (c < ATLAS_FIRST_CHAR || c > ATLAS_LAST_CHAR)
+                c = '?';
+
+            const SDL_Rect& src = glyph_atlas.rects[c];
+            if (src.w > 0) {
+                SDL_Rect dst = {pen_x, y, src.w, src.h};
+                SDL_RenderCopy(renderer, glyph_atlas.texture, &src, &dst);
+            }
+            pen_x += glyph_atlas.advance[c];
+        }
+        return;
+    }
+
+    SDL_Surface* surface = TTF_RenderText_Blended(font, text, color);
+    if (!surface)
+        return;
+
+    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
+    SDL_Rect dst = {x, y, surface->w, surface->h};
+    SDL_RenderCopy(renderer, texture, NULL, &dst);
+
+    SDL_FreeSurface(surface);
+    SDL_DestroyTexture(texture);
+}
+#endif
+
+void update_fps() {
+    fps_frames++;
+    Uint32 now = SDL_GetTicks();
+
+    if (now - fps_start_time >= 1000) {
+        fps = fps_frames * 1000.0f / (now - fps_start_time);
+#ifndef HEADLESS
+        physics_rate = (view->hud.ticks - physics_rate_ticks) * 1000.0f / (now - fps_start_time);
+        physics_rate_ticks = view->hud.ticks;
+#endif
+        fps_frames = 0;
+        fps_start_time = now;
     }
-dt = (now - last_frame_time) / 1000.0f; // в секундах
+frame_time = (now - last_frame_time) / 1000.0f; // в секундах
 last_frame_time = now;
 }
 
+#ifndef HEADLESS
+// Поток физики: свой фиксированный шаг по реальному времени, после каждой пачки тиков —
+// снимок для рендера. Рендер и vsync его больше не тормозят, и наоборот
+std::thread physics_thread;
+std::atomic<bool> physics_running{false};
+long long physics_ticks = 0;
+
+void post_input(const InputEvent& event) {
+    std::lock_guard<std::mutex> lock(input_mutex);
+    input_queue.push_back(event);
+}
+
+void post_explosion(Vec2 center) {
+    post_input({INPUT_EXPLOSION, center, 0});
+}
+
+void post_attractor(Vec2 center) {
+    post_input({INPUT_ATTRACTOR, center, 0});
+}
+
+void post_key(SDL_Keycode key) {
+    post_input({INPUT_KEY, Vec2(), key});
+}
+
+void apply_key(SDL_Keycode key) {
+    if (key == SDLK_b) {
+        BROAD_PHASE = (BROAD_PHASE + 1) % BROAD_PHASE_COUNT;
+    } else if (key == SDLK_v) {
+        PBD_KERNEL = (PBD_KERNEL + 1) % PBD_KERNEL_COUNT;
+    } else if (key == SDLK_m) {
+        SOLVER_MODE = (SOLVER_MODE + 1) % SOLVER_MODE_COUNT;
+    } else if (key == SDLK_n) {
+        COLLISION_SOLVER = (COLLISION_SOLVER + 1) % COLLISION_SOLVER_COUNT;
+    } else if (key == SDLK_i) {
+        set_integrator((INTEGRATOR + 1) % INTEGRATOR_COUNT);
+    } else if (key == SDLK_o) {
+        BOUNDARY = (BOUNDARY + 1) % BOUNDARY_COUNT;
+    } else if (key == SDLK_c) {
+        CONTINUOUS_COLLISION = !CONTINUOUS_COLLISION;
+    } else if (replaying() && key == SDLK_LEFT) {
+        replay_step(-PHYSICS_HZ);
+    } else if (replaying() && key == SDLK_RIGHT) {
+        replay_step(PHYSICS_HZ);
+    } else if (replaying() && key == SDLK_SPACE) {
+        replay_toggle_pause();
+    } else if (key == SDLK_w && !replaying()) {
+        Vec2 center = {WORLD_WIDTH * 0.5f, WORLD_HEIGHT * 0.5f};
+        add_wind(center, (float)(WORLD_WIDTH + WORLD_HEIGHT), Vec2(1.0f, -0.3f), WIND_STRENGTH, 1.0f);
+    } else if (key == SDLK_s) {
+        SLEEPING = !SLEEPING;
+        if (!SLEEPING)
+            wake_all_balls();
+    }
+}
+
+void apply_input_events() {
+    static std::vector<InputEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(input_mutex);
+        events.swap(input_queue);
+    }
+    for (const InputEvent& event : events) {
+        // при воспроизведении update() не идёт, и поля копились бы в очереди
+        if (replaying() && event.type != INPUT_KEY)
+            continue;
+        if (event.type == INPUT_EXPLOSION)
+            explode_nearby_balls(event.position, 900.0f, EXPLOSION_STRENGTH);
+        else if (event.type == INPUT_ATTRACTOR)
+            add_attractor(event.position, 300.0f, ATTRACTOR_STRENGTH, 1.0f);
+        else
+            apply_key(event.key);
+    }
+    events.clear();
+}
+
+std::vector<int> snapshot_ball_tile;
+
+// Копирует шары в снимок, раскладывая их counting sort'ом по тайлам мира, чтобы рендер
+// обходил только тайлы в окне. Тайлов не больше, чем шаров плюс запас — крупный мир
+// с редкими шарами получает крупные тайлы
+void fill_snapshot_tiles(RenderSnapshot& snapshot) {
+    int n = balls.size();
+    float top = -CEILING_OUT_OF_SCREEN;
+    float size = 128.0f;
+    int cols, rows;
+    for (;;) {
+        cols = (int)(WORLD_WIDTH / size) + 1;
+        rows = (int)((WORLD_HEIGHT - top) / size) + 1;
+        if ((long long)cols * rows <= n + 4096)
+            break;
+        size *= 2.0f;
+    }
+    snapshot.tile_x = 0.0f;
+    snapshot.tile_y = top;
+    snapshot.tile_size = size;
+    snapshot.tile_cols = cols;
+    snapshot.tile_rows = rows;
+    snapshot.tick_motion = max_displacement() * SUBSTEPS;
+
+    int tiles = cols * rows;
+    float inv_size = 1.0f / size;
+    snapshot_ball_tile.resize(n);
+    snapshot.tile_start.assign(tiles + 1, 0);
+    for (int i = 0; i < n; ++i) {
+        int cx = std::min(cols - 1, std::max(0, (int)(balls.x[i] * inv_size)));
+        int cy = std::min(rows - 1, std::max(0, (int)((balls.y[i] - top) * inv_size)));
+        int tile = cy * cols + cx;
+        snapshot_ball_tile[i] = tile;
+        snapshot.tile_start[tile + 1]++;
+    }
+    for (int t = 0; t < tiles; ++t)
+        snapshot.tile_start[t + 1] += snapshot.tile_start[t];
+
+    snapshot.tick_x.resize(n);
+    snapshot.tick_y.resize(n);
+    snapshot.x.resize(n);
+    snapshot.y.resize(n);
+    snapshot.radius.resize(n);
+    snapshot.color.resize(n);
+    // tile_start[t] служит курсором записи и после прохода указывает на конец тайла t
+    for (int i = 0; i < n; ++i) {
+        int slot = snapshot.tile_start[snapshot_ball_tile[i]]++;
+        snapshot.tick_x[slot] = balls.tick_x[i];
+        snapshot.tick_y[slot] = balls.tick_y[i];
+        snapshot.x[slot] = balls.x[i];
+        snapshot.y[slot] = balls.y[i];
+        snapshot.radius[slot] = balls.radius[i];
+        snapshot.color[slot] = balls.color[i];
+    }
+    for (int t = tiles; t > 0; --t)
+        snapshot.tile_start[t] = snapshot.tile_start[t - 1];
+    snapshot.tile_start[0] = 0;
+}
+
+void publish_snapshot() {
+    RenderSnapshot& snapshot = snapshots.write_slot();
+    fill_snapshot_tiles(snapshot);
+    snapshot.tick = 1.0f / PHYSICS_HZ;
+
+    HudStats& hud = snapshot.hud;
+    hud.broad_phase = BROAD_PHASE;
+    hud.pbd_kernel = PBD_KERNEL;
+    hud.solver_mode = SOLVER_MODE;
+    hud.collision_solver = COLLISION_SOLVER;
+    hud.integrator = INTEGRATOR;
+    hud.boundary = BOUNDARY;
+    hud.sleeping = SLEEPING;
+    hud.candidates = stat_candidates;
+    hud.contacts = stat_contacts;
+    hud.contacts_kept = stat_contacts_kept;
+    hud.contacts_added = stat_contacts_added;
+    hud.contacts_removed = stat_contacts_removed;
+    hud.solver_iterations = stat_solver_iterations;
+    hud.solver_residual = stat_solver_residual;
+    hud.static_contacts = stat_static_contacts;
+    hud.spawned = stat_spawned;
+    hud.killed = stat_killed;
+    hud.continuous_collision = CONTINUOUS_COLLISION;
+    hud.fast_balls = stat_fast_balls;
+    hud.swept_hits = stat_swept_hits;
+    hud.links = (int)distance_constraints.a.size();
+    hud.constraint_colors = stat_constraint_colors;
+    hud.pins = (int)pins.ball.size();
+    hud.constraint_error = stat_constraint_error;
+    hud.sleeping_balls = stat_sleeping;
+    hud.islands = stat_islands;
+    hud.replay_frame = replay_frame_index();
+    hud.replay_frames = replay_frame_count();
+    hud.replay_paused = replay_paused();
+    hud.ticks = physics_ticks;
+    for (int p = 0; p <= PHASE_SOLVE; ++p)
+        hud.phase_seconds[p] = phase_seconds[p];
+
+    snapshot.published = now_seconds();
+    snapshots.publish();
+}
+
+// Фиксированный шаг: копим реальное время и отрабатываем его целыми тиками.
+// Отстали — до MAX_TICKS_PER_FRAME тиков подряд, а не больший dt; успеваем — спим до следующего
+void run_physics() {
+    double tick = 1.0 / PHYSICS_HZ;
+    double accumulator = 0.0;
+    double last = now_seconds();
+
+    while (physics_running.load(std::memory_order_relaxed)) {
+        apply_input_events();
+
+        double now = now_seconds();
+        accumulator += now - last;
+        last = now;
+
+        int ticks = 0;
+        while (accumulator >= tick && ticks < MAX_TICKS_PER_FRAME) {
+            PROFILE_SCOPE("tick");
+            if (replaying())
+                replay_tick();
+            else
+                update();
+            accumulator -= tick;
+            ticks++;
+            physics_ticks++;
+        }
+
+        // не успеваем — отстаём от реального времени, но не копим долг до спирали
+        if (accumulator >= tick)
+            accumulator = fmod(accumulator, tick);
+
+        if (ticks > 0)
+            publish_snapshot();
+        else
+            std::this_thread::sleep_for(std::chrono::duration<double>(tick - accumulator));
+    }
+}
+
+void start_physics_thread() {
+    publish_snapshot();
+    physics_running = true;
+    physics_thread = std::thread(run_physics);
+}
+
+void stop_physics_thread() {
+    if (!physics_running)
+        return;
+    physics_running = false;
+    physics_thread.join();
+}
+#endif
+
+// Один тик физики: SUBSTEPS подшагов, итерации солвера делятся между ними
 void update() {
-    for (auto& ball : balls)
-        update_ball(ball);
-        
-    auto collision_pairs = detect_collisions();
+    update_ball_lifecycle(1.0f / PHYSICS_HZ);
 
-    // сортируем по убыванию глубины проникновения
-    std::sort(collision_pairs.begin(), collision_pairs.end(), [](const BallPair& a, const BallPair& b) { return a.penetration > b.penetration; });
+    std::copy(balls.x.begin(), balls.x.end(), balls.tick_x.begin());
+    std::copy(balls.y.begin(), balls.y.end(), balls.tick_y.begin());
 
-    //resolve_collisions_naive_iterative(collision_pairs, RESOLVE_STEPS);
-    //resolve_collisions_impulse_baumgarte(collision_pairs, RESOLVE_STEPS);
-    resolve_collisions_pbd(collision_pairs, RESOLVE_STEPS);
-    
+    reorder_balls_if_due();
+    apply_force_fields(1.0f / PHYSICS_HZ);
+
+    dt = 1.0f / (PHYSICS_HZ * SUBSTEPS);
+    for (int s = 0; s < SUBSTEPS; ++s)
+        step();
+
+    if (SLEEPING) {
+        PROFILE_SCOPE("sleep");
+        update_sleep(1.0f / PHYSICS_HZ);
+    }
+
+    record_frame();
 }
 
+#ifndef HEADLESS
 void draw() {
     SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
 
+    collect_visible_ranges();
+    if (RENDER_MODE == RENDER_SOFTWARE) {
+        // текстура закрывает весь экран, рамку рисуем поверх
+        draw_balls_software();
+        draw_border();
+        draw_static_colliders();
+        return;
+    }
     draw_border();
-    for (const Ball& ball : balls)
-    draw_ball(ball);
+    draw_static_colliders();
+    if (RENDER_MODE == RENDER_LINES) {
+        for (const std::pair<int, int>& range : visible_ranges)
+            for (int i = range.first; i < range.second; ++i)
+                draw_ball(i);
+    } else {
+        draw_balls_batched(RENDER_MODE == RENDER_BATCHED_FILLED);
+    }
 }
 
 void draw_texts() {
@@ -313,11 +2548,112 @@ sprintf(ver_buf, "SDL compiled: %d.%d.%d  linked: %d.%d.%d",
 //draw_text(ver_buf, 20, 70);
 
     char balls_no_buf[64];
-    sprintf(balls_no_buf, "Balls count: %d", BALLS_COUNT);
+    sprintf(balls_no_buf, "Balls count: %d", view->size());
     draw_text(balls_no_buf, 400, 20);
+
+    const char* broad_phase_names[BROAD_PHASE_COUNT] = {"sweep", "grid"};
+    char broad_buf[64];
+    const HudStats& hud = view->hud;
+    sprintf(broad_buf, "Broad phase [B]: %s", broad_phase_names[hud.broad_phase]);
+    draw_text(broad_buf, 400, 50);
+
+    const char* kernel_names[PBD_KERNEL_COUNT] = {"scalar", "simd"};
+    char kernel_buf[64];
+    sprintf(kernel_buf, "PBD kernel [V]: %s", kernel_names[hud.pbd_kernel]);
+    draw_text(kernel_buf, 400, 80);
+
+    const char* solver_names[SOLVER_MODE_COUNT] = {"serial GS", "parallel GS", "jacobi"};
+    char solver_buf[64];
+    if (hud.collision_solver == COLLISION_PBD)
+        sprintf(solver_buf, "Solver [N/M]: pbd %s, %d threads", solver_names[hud.solver_mode], thread_pool.threads);
+    else
+        sprintf(solver_buf, "Solver [N]: %s", COLLISION_SOLVER_NAMES[hud.collision_solver]);
+    draw_text(solver_buf, 400, 110);
+
+    const char* render_names[RENDER_MODE_COUNT] = {"lines", "batched outline", "batched filled", "software"};
+    char render_buf[64];
+    if (RENDER_MODE == RENDER_SOFTWARE)
+        sprintf(render_buf, "Render [R]: software, %d threads", render_pool.threads);
+    else
+        sprintf(render_buf, "Render [R]: %s", render_names[RENDER_MODE]);
+    draw_text(render_buf, 400, 170);
+
+    char physics_buf[96];
+    sprintf(physics_buf, "Physics: %d Hz x %d substeps, %.1f ticks/s", PHYSICS_HZ, SUBSTEPS, physics_rate);
+    draw_text(physics_buf, 400, 140);
+
+    char pipeline_buf[96];
+    sprintf(pipeline_buf, "Integrator [I]: %s, boundary [O]: %s", INTEGRATOR_NAMES[hud.integrator], BOUNDARY_NAMES[hud.boundary]);
+    draw_text(pipeline_buf, 400, 290);
+
+    char ccd_buf[96];
+    if (hud.continuous_collision)
+        sprintf(ccd_buf, "CCD [C]: %d fast balls, %d stopped at first contact", hud.fast_balls, hud.swept_hits);
+    else
+        sprintf(ccd_buf, "CCD [C]: off, max %.0f px per substep", MAX_DISPLACEMENT);
+    draw_text(ccd_buf, 400, 410);
+
+    char camera_buf[128];
+    sprintf(camera_buf, "Camera: x%.2f, %d of %d balls drawn [wheel, middle drag, arrows, Home]",
+            camera.zoom, stat_visible, view->size());
+    draw_text(camera_buf, 400, 320);
+
+    if (!static_colliders.empty()) {
+        char scene_buf[96];
+        sprintf(scene_buf, "Scene: %d colliders, %d contacts", (int)static_colliders.size(), hud.static_contacts);
+        draw_text(scene_buf, 400, 350);
+    }
+    if (!emitters.empty() || !kill_zones.empty()) {
+        char life_buf[96];
+        sprintf(life_buf, "Emitters: %d, kill zones: %d, +%d/-%d balls per tick", (int)emitters.size(),
+                (int)kill_zones.size(), hud.spawned, hud.killed);
+        draw_text(life_buf, 400, 380);
+    }
+    if (hud.links > 0 || hud.pins > 0) {
+        char bodies_buf[128];
+        sprintf(bodies_buf, "Bodies: %d links in %d colors, %d pins, max stretch %.2f px",
+                hud.links, hud.constraint_colors, hud.pins, hud.constraint_error);
+        draw_text(bodies_buf, 400, 440);
+    }
+
+    if (replaying()) {
+        char replay_buf[128];
+        sprintf(replay_buf, "Replay: frame %d/%d%s [Left/Right: -/+1 s, Space: pause]",
+                hud.replay_frame + 1, hud.replay_frames, hud.replay_paused ? ", paused" : "");
+        draw_text(replay_buf, 400, 260);
+    }
+
+    char iterations_buf[96];
+    sprintf(iterations_buf, "Iterations: %d/%d, residual %.3f px", hud.solver_iterations,
+            std::max(1, RESOLVE_STEPS / SUBSTEPS), hud.solver_residual);
+    draw_text(iterations_buf, 400, 230);
+
+    char sleep_buf[96];
+    if (hud.sleeping)
+        sprintf(sleep_buf, "Sleeping [S]: %d balls, %d islands", hud.sleeping_balls, hud.islands);
+    else
+        sprintf(sleep_buf, "Sleeping [S]: off");
+    draw_text(sleep_buf, 400, 200);
+
+#if PROFILING
+    char phase_buf[64];
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        sprintf(phase_buf, "%s: %.2f ms", PHASE_NAMES[p], phase_frame_ms[p]);
+        draw_text(phase_buf, 20, 80 + 30 * p);
+    }
+    char pairs_buf[96];
+    sprintf(pairs_buf, "Pairs: %d candidates, %d contacts", hud.candidates, hud.contacts);
+    draw_text(pairs_buf, 20, 80 + 30 * PHASE_COUNT);
+    char cache_buf[96];
+    sprintf(cache_buf, "Contact cache: %d kept, %d added, %d removed", hud.contacts_kept, hud.contacts_added, hud.contacts_removed);
+    draw_text(cache_buf, 20, 110 + 30 * PHASE_COUNT);
+    if (trace_recording)
+        draw_text("Recording trace [T]...", 20, 140 + 30 * PHASE_COUNT, SDL_Color{255, 80, 80, 255});
+#endif
 }
+#endif
 
-void init_ball(int x, int y) {
+Ball random_ball(float x, float y) {
     Ball b;
     b.pos.x = x;
     b.pos.y = y;
@@ -331,221 +2667,919 @@ void init_ball(int x, int y) {
     Uint8 bl = static_cast<Uint8>(160 + rand() % 96);        // доминирующий синий (160–255)
 
     b.color = { r, g, bl, 255 };
+    return b;
+}
 
-    balls.push_back(b);
+void init_ball(int x, int y) {
+    balls.push_back(random_ball((float)x, (float)y));
 }
 
 
 void init_balls(int count) {
     balls.clear();
-    balls.reserve(count);
+    clear_contact_cache();
+    balls.reserve(ball_capacity());
+    spawn_scene_bodies();
 
     int step = MIN_SIZE + MAX_SIZE + 20;
-    int max_cols = SCREEN_WIDTH / step;
+    int max_cols = WORLD_WIDTH / step;
 
-    for (int i = 0; i < count; ++i) {
-        int col = i % max_cols;
-        int row = i / max_cols;
+    // места, занятые статической геометрией и телами сцены, пропускаем
+    int total = balls.size() + count;
+    for (int slot = 0; balls.size() < total; ++slot) {
+        int col = slot % max_cols;
+        int row = slot / max_cols;
 
         int x = col * step;
-        int y = SCREEN_HEIGHT - step * (row + 1);  // снизу вверх, начиная от пола
+        int y = WORLD_HEIGHT - step * (row + 1);  // снизу вверх, начиная от пола
 
+        if (overlaps_static_geometry((float)x, (float)y, step * 0.5f) || overlaps_scene_body((float)x, (float)y, step * 0.5f))
+            continue;
         init_ball(x, y);
     }
 }
 
-void update_ball_by_velocity(Ball& b) {
-    b.vel.y += GRAVITY * dt;
-    b.pos.x += b.vel.x * dt;
-    b.pos.y += b.vel.y * dt;
+// Сколько шар может пройти за подшаг: на это же рассчитаны запасы в индексах, построенных раньше
+float max_displacement() {
+    return CONTINUOUS_COLLISION ? CCD_MAX_DISPLACEMENT : MAX_DISPLACEMENT;
 }
 
-void update_ball_verlet_by_pos(Ball& b) {
-    float max_displacement = 5.0f;  // настраиваемое ограничение
-    
-    Vec2 temp = b.pos;
-    Vec2 acceleration = {0.0f, GRAVITY};
-    b.pos += (b.pos - b.prev_pos) + acceleration * (dt * dt);
+// Шаг собран из трёх политик: интегратор, граница мира и солвер. Каждое сочетание
+// инстанцируется один раз, так что во внутреннем цикле по шарам нет ни ветвлений
+// по режиму, ни вызовов — выбор делается один раз на подшаг через таблицу step_functions
+struct IntegrateConstants {
+    float dt;
+    float gravity;           // ускорение за подшаг для Верле: GRAVITY * dt^2
+    float max_displacement;
+    float floor_y;
+    float ceiling_y;
+    float right_x;
+};
 
-    // Ограничение максимального смещения за кадр (скорости)
-    Vec2 velocity = b.pos - b.prev_pos;
-    
-    float len = velocity.length();
-    if (len > max_displacement) {
-        velocity = velocity * (max_displacement / len);
-        b.pos = b.prev_pos + velocity;
+struct VelocityIntegrator {
+    static inline void integrate(float& x, float& y, float& px, float& py, float& vx, float& vy,
+                                 const IntegrateConstants& c) {
+        px = x;
+        py = y;
+        vy += GRAVITY * c.dt;
+        x += vx * c.dt;
+        y += vy * c.dt;
     }
 
-    b.prev_pos = temp;
-}
-
+    // позиционный солвер vel не трогает — скорость берём из итогового смещения за подшаг
+    static const bool needs_velocity_sync = true;
+};
 
-void update_ball_walls_and_floor(Ball& b) {
+struct VerletIntegrator {
+    static inline void integrate(float& x, float& y, float& px, float& py, float& /*vx*/, float& /*vy*/,
+                                 const IntegrateConstants& c) {
+        float px_old = px;
+        float py_old = py;
+        float new_x = x + (x - px_old);
+        float new_y = y + ((y - py_old) + c.gravity);
+
+        // Ограничение максимального смещения за кадр (скорости)
+        float vel_x = new_x - px_old;
+        float vel_y = new_y - py_old;
+        float len2 = vel_x * vel_x + vel_y * vel_y;
+        bool clamp = len2 > c.max_displacement * c.max_displacement;
+        float scale = c.max_displacement / sqrtf(len2);
+
+        px = x;
+        py = y;
+        x = clamp ? (px_old + vel_x * scale) : new_x;
+        y = clamp ? (py_old + vel_y * scale) : new_y;
+    }
 
-    float CEILING_OUT_OF_SCREEN = 1080;
-    // Границы
-    float floor_y = (float)(SCREEN_HEIGHT - b.radius);
-    float ceiling_y = -CEILING_OUT_OF_SCREEN + b.radius; // потолок выше экрана
-    float left_x = (float)b.radius;
-    float right_x = (float)(SCREEN_WIDTH - b.radius);
+    static const bool needs_velocity_sync = false;
+};
 
-    // Отскок от пола
-    if (b.pos.y > floor_y) {
-        b.pos.y = floor_y;
-        b.vel.y = -b.vel.y * 0.7f;
-        //b.prev_pos = b.pos;
+// Прижимает к стенам и полу; отскок только у скорости, Верле у стены просто гасит движение
+struct ClampBoundary {
+    static inline void apply(float& x, float& y, float& /*px*/, float& /*py*/, float& vx, float& vy, float radius,
+                             const IntegrateConstants& c) {
+        float floor_y = c.floor_y - radius;
+        float ceiling_y = c.ceiling_y + radius;  // потолок выше экрана
+        float left_x = radius;
+        float right_x = c.right_x - radius;
+
+        // Отскок от пола и потолка
+        bool hit_y = y > floor_y || y < ceiling_y;
+        y = std::min(std::max(y, ceiling_y), floor_y);
+        vy = hit_y ? -vy * 0.7f : vy;
+
+        // Отскок от стен
+        bool hit_x = x < left_x || x > right_x;
+        x = std::min(std::max(x, left_x), right_x);
+        vx = hit_x ? -vx * 0.7f : vx;
     }
+};
 
-    // Отскок от потолка
-    if (b.pos.y < ceiling_y) {
-        b.pos.y = ceiling_y;
-        b.vel.y = -b.vel.y * 0.7f;
-        //b.prev_pos = b.pos;
+// То же, но и Верле отскакивает: прошлая позиция отражается за стену с тем же 0.7
+struct BounceBoundary {
+    static inline void apply(float& x, float& y, float& px, float& py, float& vx, float& vy, float radius,
+                             const IntegrateConstants& c) {
+        float step_x = x - px;
+        float step_y = y - py;
+        float floor_y = c.floor_y - radius;
+        float ceiling_y = c.ceiling_y + radius;
+        float left_x = radius;
+        float right_x = c.right_x - radius;
+
+        bool hit_y = y > floor_y || y < ceiling_y;
+        y = std::min(std::max(y, ceiling_y), floor_y);
+        vy = hit_y ? -vy * 0.7f : vy;
+        py = hit_y ? y + step_y * 0.7f : py;
+
+        bool hit_x = x < left_x || x > right_x;
+        x = std::min(std::max(x, left_x), right_x);
+        vx = hit_x ? -vx * 0.7f : vx;
+        px = hit_x ? x + step_x * 0.7f : px;
     }
+};
 
-    // Отскок от стен
-    if (b.pos.x < left_x) {
-        b.pos.x = left_x;
-        b.vel.x = -b.vel.x * 0.7f;
-        //b.prev_pos = b.pos;
-    } else if (b.pos.x > right_x) {
-        b.pos.x = right_x;
-        b.vel.x = -b.vel.x * 0.7f;
-        //b.prev_pos = b.pos;
+template <class Integrator, class Boundary>
+void integrate_balls(int begin, int end) {
+    IntegrateConstants c;
+    c.dt = dt;
+    c.gravity = GRAVITY * (dt * dt);
+    c.max_displacement = max_displacement();
+    c.floor_y = (float)WORLD_HEIGHT;
+    c.ceiling_y = -CEILING_OUT_OF_SCREEN;
+    c.right_x = (float)WORLD_WIDTH;
+
+    float* __restrict x = balls.x.data();
+    float* __restrict y = balls.y.data();
+    float* __restrict px = balls.prev_x.data();
+    float* __restrict py = balls.prev_y.data();
+    float* __restrict vx = balls.vel_x.data();
+    float* __restrict vy = balls.vel_y.data();
+    const float* __restrict radius = balls.radius.data();
+    const Uint8* __restrict asleep = balls.asleep.data();
+
+    for (int i = begin; i < end; ++i) {
+        if (asleep[i])
+            continue;
+        Integrator::integrate(x[i], y[i], px[i], py[i], vx[i], vy[i], c);
+        Boundary::apply(x[i], y[i], px[i], py[i], vx[i], vy[i], radius[i], c);
     }
-    
 }
 
+// Скорости после позиционного солвера: (x - prev) / dt, prev запомнен при интегрировании
+void sync_velocities(int begin, int end) {
+    float inv_dt = 1.0f / dt;
+    for (int i = begin; i < end; ++i) {
+        if (balls.asleep[i])
+            continue;
+        balls.vel_x[i] = (balls.x[i] - balls.prev_x[i]) * inv_dt;
+        balls.vel_y[i] = (balls.y[i] - balls.prev_y[i]) * inv_dt;
+    }
+}
 
-void update_ball(Ball& b) {
-    bool use_verlet = true;
+struct NaiveSolver {
+    static const bool position_based = false;
 
-    if (!use_verlet) {
-        update_ball_by_velocity(b);
-    } else {
-        update_ball_verlet_by_pos(b);
+    static void solve(std::vector<BallPair>& pairs, int iterations) {
+        resolve_collisions_naive_iterative(pairs, iterations);
+        clear_contact_cache();
     }
+};
 
-    update_ball_walls_and_floor(b);
-}
+struct ImpulseSolver {
+    static const bool position_based = false;
 
-std::vector<BallPair> broad_phase() {
-    std::vector<BallPair> candidates;
+    static void solve(std::vector<BallPair>& pairs, int iterations) {
+        resolve_collisions_impulse(pairs, iterations);
+        clear_contact_cache();
+    }
+};
 
-    std::vector<int> indices(balls.size());
-    for (int i = 0; i < balls.size(); ++i)
-        indices[i] = i;
+struct BaumgarteSolver {
+    static const bool position_based = false;
 
-    std::sort(indices.begin(), indices.end(), [](int i, int j) {
-        return balls[i].pos.x - balls[i].radius < balls[j].pos.x - balls[j].radius;
-    });
+    static void solve(std::vector<BallPair>& pairs, int iterations) {
+        resolve_collisions_impulse_baumgarte(pairs, iterations);
+        clear_contact_cache();
+    }
+};
+
+// лямбды копит только PBD; остальные чистят кэш, и после переключения PBD начнёт с холодного
+struct PbdSolver {
+    static const bool position_based = true;
+
+    static void solve(std::vector<BallPair>& pairs, int iterations) {
+        warm_start_from_cache(pairs);
+        if (SOLVER_MODE == SOLVER_JACOBI)
+            resolve_collisions_jacobi(pairs, iterations);
+        else
+            resolve_collisions_pbd(pairs, iterations);
+        store_contact_cache(pairs);
+    }
+};
 
-    for (int i = 0; i < indices.size(); ++i) {
-        const Ball& a = balls[indices[i]];
-        float ax_max = a.pos.x + a.radius;
+template <class Integrator, class Boundary, class Solver>
+void step_pipeline() {
+    int iterations = std::max(1, RESOLVE_STEPS / SUBSTEPS);
 
-        for (int j = i + 1; j < indices.size(); ++j) {
-            const Ball& b = balls[indices[j]];
-            float bx_min = b.pos.x - b.radius;
+    {
+        PROFILE_PHASE(PHASE_INTEGRATE);
+        thread_pool.parallel_for(0, balls.size(), 1024, [](int begin, int end) { integrate_balls<Integrator, Boundary>(begin, end); });
+    }
 
-            if (bx_min > ax_max)
-                break;
+    std::vector<BallPair>& collision_pairs = detect_collisions();
 
-            candidates.push_back({indices[i], indices[j]});
-        }
+    // сортируем по убыванию глубины проникновения
+    {
+        PROFILE_PHASE(PHASE_SORT);
+        std::sort(collision_pairs.begin(), collision_pairs.end(), [](const BallPair& a, const BallPair& b) { return a.penetration > b.penetration; });
     }
 
-    return candidates;
+    PROFILE_PHASE(PHASE_SOLVE);
+    reset_constraint_lambdas();
+    Solver::solve(collision_pairs, iterations);
+    // позиционные солверы проецируют статику и связи внутри своих итераций, скоростным
+    // хватает проходов после; у явного Эйлера поправка связи идёт и в vel
+    if (!Solver::position_based) {
+        float velocity_scale = Integrator::needs_velocity_sync ? (float)(PHYSICS_HZ * SUBSTEPS) : 0.0f;
+        for (int k = 0; k < iterations; ++k)
+            solve_ball_constraints(true, velocity_scale);
+        solve_static_contacts(true);
+    }
+    if (Solver::position_based && Integrator::needs_velocity_sync)
+        thread_pool.parallel_for(0, balls.size(), 1024, sync_velocities);
 }
 
-bool test_circle_collision(const Ball& a, const Ball& b) {
-    float dx = a.pos.x - b.pos.x;
-    float dy = a.pos.y - b.pos.y;
-    float r = a.radius + b.radius;
-    return dx * dx + dy * dy < r * r;
+template <class Integrator, class Boundary>
+void add_step_functions(void (**functions)()) {
+    functions[COLLISION_NAIVE] = step_pipeline<Integrator, Boundary, NaiveSolver>;
+    functions[COLLISION_IMPULSE] = step_pipeline<Integrator, Boundary, ImpulseSolver>;
+    functions[COLLISION_BAUMGARTE] = step_pipeline<Integrator, Boundary, BaumgarteSolver>;
+    functions[COLLISION_PBD] = step_pipeline<Integrator, Boundary, PbdSolver>;
 }
 
-std::vector<BallPair> detect_collisions() {
-    
-    for (auto& ball : balls)
-        ball.colliding = false;
-    
-    std::vector<BallPair> result;
-    std::vector<BallPair> candidates = broad_phase();
+typedef void (*StepFunction)();
 
-    for (const BallPair& pair : candidates) {
-        const Ball& a = balls[pair.a];
-        const Ball& b = balls[pair.b];
+struct StepFunctionTable {
+    StepFunction functions[INTEGRATOR_COUNT][BOUNDARY_COUNT][COLLISION_SOLVER_COUNT];
 
-        if (test_circle_collision(a, b)) {
-            float dx = a.pos.x - b.pos.x;
-            float dy = a.pos.y - b.pos.y;
-            float dist = sqrtf(dx * dx + dy * dy);
-            float penetration = (a.radius + b.radius) - dist;
-            
-            BallPair p = pair;
-            p.penetration = penetration;
-            result.push_back(p);
-            balls[pair.a].colliding = true;
-            balls[pair.b].colliding = true;
-        }
+    StepFunctionTable() {
+        add_step_functions<VerletIntegrator, ClampBoundary>(functions[INTEGRATOR_VERLET][BOUNDARY_CLAMP]);
+        add_step_functions<VerletIntegrator, BounceBoundary>(functions[INTEGRATOR_VERLET][BOUNDARY_BOUNCE]);
+        add_step_functions<VelocityIntegrator, ClampBoundary>(functions[INTEGRATOR_VELOCITY][BOUNDARY_CLAMP]);
+        add_step_functions<VelocityIntegrator, BounceBoundary>(functions[INTEGRATOR_VELOCITY][BOUNDARY_BOUNCE]);
     }
+};
+
+StepFunctionTable step_functions;
 
-    return result;
+void step() {
+    step_functions.functions[INTEGRATOR][BOUNDARY][COLLISION_SOLVER]();
 }
 
-void resolve_collisions_naive_iterative(const std::vector<BallPair>& pairs, int iterations) {
-    for (int i = 0; i < iterations; ++i) {
-        for (const BallPair& pair : pairs) {
-            Ball& a = balls[pair.a];
-            Ball& b = balls[pair.b];
+// Переключение интегратора на лету: скорость одного выводится из состояния другого,
+// чтобы шары не останавливались и не улетали
+void set_integrator(int integrator) {
+    if (integrator == INTEGRATOR)
+        return;
+    float step_dt = 1.0f / (PHYSICS_HZ * SUBSTEPS);
+    for (int i = 0; i < balls.size(); ++i) {
+        if (integrator == INTEGRATOR_VELOCITY) {
+            balls.vel_x[i] = (balls.x[i] - balls.prev_x[i]) / step_dt;
+            balls.vel_y[i] = (balls.y[i] - balls.prev_y[i]) / step_dt;
+        } else {
+            balls.prev_x[i] = balls.x[i] - balls.vel_x[i] * step_dt;
+            balls.prev_y[i] = balls.y[i] - balls.vel_y[i] * step_dt;
+        }
+    }
+    INTEGRATOR = integrator;
+}
 
-            SDL_FPoint diff = {b.pos.x - a.pos.x, b.pos.y - a.pos.y};
-            float dist_sq = diff.x * diff.x + diff.y * diff.y;
-            float min_dist = a.radius + b.radius;
+// Узкая фаза встроена в обход пар: кандидата не сохраняем, сразу проверяем пересечение
+// (с запасом CONTACT_MARGIN) и кладём контакт в contact_pairs
+inline void test_contact(int a, int b, float dx, float dy, float r) {
+    // спящие не двигаются, их контакты друг с другом решать незачем
+    if (balls.asleep[a] & balls.asleep[b])
+        return;
 
-            if (dist_sq == 0.0f) {
-                diff = {1.0f, 0.0f};
-                dist_sq = 1.0f;
-            }
+    float reach = r + CONTACT_MARGIN;
+    float dist2 = dx * dx + dy * dy;
+    if (dist2 >= reach * reach)
+        return;
 
-            float dist = sqrtf(dist_sq);
-            float overlap = min_dist - dist;
+    BallPair p;
+    p.a = a;
+    p.b = b;
+    p.penetration = r - sqrtf(dist2);
+    contact_pairs.push_back(p);
+    balls.colliding[a] = true;
+    balls.colliding[b] = true;
+}
 
-            if (overlap > 0.0f) {
-                SDL_FPoint n = {diff.x / dist, diff.y / dist};
-                float move = overlap * 0.5f;
+void broad_phase() {
+    if (BROAD_PHASE == BROAD_PHASE_GRID)
+        broad_phase_grid();
+    else
+        broad_phase_sweep();
+}
 
-                a.pos.x -= n.x * move;
-                a.pos.y -= n.y * move;
-                b.pos.x += n.x * move;
-                b.pos.y += n.y * move;
+void collect_contacts() {
+    if (BROAD_PHASE == BROAD_PHASE_GRID)
+        collect_contacts_grid();
+    else
+        collect_contacts_sweep();
+}
 
-                float v_rel = (b.vel.x - a.vel.x) * n.x + (b.vel.y - a.vel.y) * n.y;
-                if (v_rel < 0.0f) {
-                    float impulse = -v_rel;
-                    a.vel.x -= n.x * impulse;
-                    a.vel.y -= n.y * impulse;
-                    b.vel.x += n.x * impulse;
-                    b.vel.y += n.y * impulse;
-                }
-            }
+// Буферы сетки живут между кадрами, чтобы не аллоцировать их заново
+std::vector<int> grid_ball_cell;   // ячейка каждого шара
+std::vector<int> grid_cell_start;  // начало корзины ячейки в grid_cell_balls (+1 элемент в конце)
+std::vector<int> grid_cell_balls;  // индексы шаров, разложенные по ячейкам
+int grid_cols = 0, grid_rows = 0;  // 0 — сетка на прошлом подшаге не строилась
+float grid_min_x = 0.0f, grid_min_y = 0.0f, grid_cell_size = 1.0f;
+
+// Sweep and prune: порядок шаров по левому краю хранится между подшагами.
+// За подшаг шары почти не меняют порядок по X, поэтому сортировка вставками
+// досортировывает его за O(n + число перестановок)
+std::vector<int> sweep_order;
+std::vector<float> sweep_min_x;                  // x - r в порядке sweep_order
+std::vector<float> sweep_x, sweep_y, sweep_r;    // копии в том же порядке для обхода подряд
+
+void broad_phase_sweep() {
+    int n = balls.size();
+    grid_cols = grid_rows = 0;
+
+    // количество шаров поменялось — строим порядок с нуля
+    if ((int)sweep_order.size() != n) {
+        sweep_order.resize(n);
+        for (int i = 0; i < n; ++i)
+            sweep_order[i] = i;
+        std::sort(sweep_order.begin(), sweep_order.end(), [](int i, int j) {
+            return balls.x[i] - balls.radius[i] < balls.x[j] - balls.radius[j];
+        });
+    }
+
+    sweep_min_x.resize(n);
+    for (int k = 0; k < n; ++k) {
+        int i = sweep_order[k];
+        sweep_min_x[k] = balls.x[i] - balls.radius[i];
+    }
+
+    int swaps = 0;
+    for (int k = 1; k < n; ++k) {
+        float key = sweep_min_x[k];
+        if (sweep_min_x[k - 1] <= key)
+            continue;
+
+        int ball = sweep_order[k];
+        int j = k;
+        while (j > 0 && sweep_min_x[j - 1] > key) {
+            sweep_min_x[j] = sweep_min_x[j - 1];
+            sweep_order[j] = sweep_order[j - 1];
+            --j;
         }
+        sweep_min_x[j] = key;
+        sweep_order[j] = ball;
+        swaps += k - j;
+    }
+    stat_sweep_swaps = swaps;
+
+    sweep_x.resize(n);
+    sweep_y.resize(n);
+    sweep_r.resize(n);
+    for (int k = 0; k < n; ++k) {
+        int i = sweep_order[k];
+        sweep_x[k] = balls.x[i];
+        sweep_y[k] = balls.y[i];
+        sweep_r[k] = balls.radius[i];
     }
 }
 
-void resolve_collisions_impulse(const std::vector<BallPair>& pairs, int iterations) {
-    for (int iter = 0; iter < iterations; ++iter) {
-        for (const BallPair& pair : pairs) {
-            Ball& a = balls[pair.a];
-            Ball& b = balls[pair.b];
+void collect_contacts_sweep() {
+    int n = (int)sweep_order.size();
+    const float* min_x = sweep_min_x.data();
+    const float* x = sweep_x.data();
+    const float* y = sweep_y.data();
+    const float* r = sweep_r.data();
+    int candidates = 0;
 
-Vec2 pos_a(a.pos.x, a.pos.y);
-            Vec2 pos_b(b.pos.x, b.pos.y);
+    for (int i = 0; i < n; ++i) {
+        float ax_max = x[i] + r[i] + CONTACT_MARGIN;
 
-            Vec2 delta = pos_b - pos_a;
-            float dist_sq = delta.length_squared();
-            float radius_sum = a.radius + b.radius;
+        for (int j = i + 1; j < n; ++j) {
+            if (min_x[j] > ax_max)
+                break;
+
+            ++candidates;
+            test_contact(sweep_order[i], sweep_order[j], x[i] - x[j], y[i] - y[j], r[i] + r[j]);
+        }
+    }
+
+    stat_candidates = candidates;
+}
+
+void broad_phase_grid() {
+    int n = balls.size();
+    grid_cols = grid_rows = 0;
+    if (n == 0)
+        return;
+
+    // Ячейка не меньше диаметра самого большого шара (радиус < MIN_SIZE + MAX_SIZE),
+    // тогда пересекающиеся шары всегда лежат в соседних ячейках
+    float cell_size = 2.0f * (MIN_SIZE + MAX_SIZE);
+
+    float min_x = balls.x[0], max_x = min_x;
+    float min_y = balls.y[0], max_y = min_y;
+    for (int i = 0; i < n; ++i) {
+        min_x = std::min(min_x, balls.x[i]);
+        max_x = std::max(max_x, balls.x[i]);
+        min_y = std::min(min_y, balls.y[i]);
+        max_y = std::max(max_y, balls.y[i]);
+    }
+
+    // Если шары разлетелись слишком далеко, укрупняем ячейки, чтобы сетка не раздувалась
+    int max_cells = 4 * n + 1024;
+    int cols, rows;
+    for (;;) {
+        cols = (int)((max_x - min_x) / cell_size) + 1;
+        rows = (int)((max_y - min_y) / cell_size) + 1;
+        if ((long long)cols * rows <= max_cells)
+            break;
+        cell_size *= 2.0f;
+    }
+    int cells = cols * rows;
+    float inv_cell = 1.0f / cell_size;
+    grid_cols = cols;
+    grid_rows = rows;
+    grid_min_x = min_x;
+    grid_min_y = min_y;
+    grid_cell_size = cell_size;
+
+    // Counting sort шаров по ячейкам
+    grid_ball_cell.resize(n);
+    grid_cell_start.assign(cells + 1, 0);
+    grid_cell_balls.resize(n);
+
+    for (int i = 0; i < n; ++i) {
+        int cx = std::min(cols - 1, (int)((balls.x[i] - min_x) * inv_cell));
+        int cy = std::min(rows - 1, (int)((balls.y[i] - min_y) * inv_cell));
+        int cell = cy * cols + cx;
+        grid_ball_cell[i] = cell;
+        grid_cell_start[cell + 1]++;
+    }
+    for (int c = 0; c < cells; ++c)
+        grid_cell_start[c + 1] += grid_cell_start[c];
+    for (int i = 0; i < n; ++i) {
+        int cell = grid_ball_cell[i];
+        grid_cell_balls[grid_cell_start[cell]++] = i;
+    }
+    // после раскладки start[c] указывает на конец корзины c — сдвигаем обратно
+    for (int c = cells; c > 0; --c)
+        grid_cell_start[c] = grid_cell_start[c - 1];
+    grid_cell_start[0] = 0;
+}
+
+void collect_contacts_grid() {
+    int cols = grid_cols;
+    int rows = grid_rows;
+    const float* x = balls.x.data();
+    const float* y = balls.y.data();
+    const float* radius = balls.radius.data();
+    int candidates = 0;
+
+    // Каждую пару соседних ячеек смотрим один раз: своя ячейка + 4 соседа "вперёд"
+    const int neighbor_dx[4] = {1, -1, 0, 1};
+    const int neighbor_dy[4] = {0, 1, 1, 1};
+
+    for (int cy = 0; cy < rows; ++cy) {
+        for (int cx = 0; cx < cols; ++cx) {
+            int cell = cy * cols + cx;
+            int begin = grid_cell_start[cell];
+            int end = grid_cell_start[cell + 1];
+            if (begin == end)
+                continue;
+
+            for (int i = begin; i < end; ++i) {
+                int a = grid_cell_balls[i];
+                for (int j = i + 1; j < end; ++j) {
+                    int b = grid_cell_balls[j];
+                    test_contact(a, b, x[a] - x[b], y[a] - y[b], radius[a] + radius[b]);
+                }
+                candidates += end - i - 1;
+            }
+
+            for (int k = 0; k < 4; ++k) {
+                int nx = cx + neighbor_dx[k];
+                int ny = cy + neighbor_dy[k];
+                if (nx < 0 || nx >= cols || ny >= rows)
+                    continue;
+
+                int other = ny * cols + nx;
+                int other_begin = grid_cell_start[other];
+                int other_end = grid_cell_start[other + 1];
+                for (int i = begin; i < end; ++i) {
+                    int a = grid_cell_balls[i];
+                    for (int j = other_begin; j < other_end; ++j) {
+                        int b = grid_cell_balls[j];
+                        test_contact(a, b, x[a] - x[b], y[a] - y[b], radius[a] + radius[b]);
+                    }
+                }
+                candidates += (end - begin) * (other_end - other_begin);
+            }
+        }
+    }
+
+    stat_candidates = candidates;
+}
+
+// Косвенная мера локальности: насколько далеко в массивах лежат шары одного контакта
+double mean_contact_index_distance() {
+    if (contact_pairs.empty())
+        return 0.0;
+    double sum = 0.0;
+    for (const BallPair& pair : contact_pairs)
+        sum += abs(pair.a - pair.b);
+    return sum / contact_pairs.size();
+}
+
+// Непрерывные столкновения (--ccd). Срезка смещения поднята до CCD_MAX_DISPLACEMENT,
+// а шар, прошедший за подшаг больше MIN_SIZE, заметается: ищется первое касание на отрезке
+// prev -> x с соседями (их движение за подшаг тоже учитывается) и со статикой. Шар
+// ставится в точку касания, остаток пути идёт только вдоль касательной — проникающая
+// часть и была бы туннелированием. Дальше обычная узкая фаза находит пару касающейся
+// (в пределах CONTACT_MARGIN), и солвер держит её как любой контакт.
+// Ограничение: это усечение по времени удара, а не спекулятивные контакты — шар,
+// задетый посреди подшага, теряет остаток движения этого подшага, кроме скольжения,
+// даже если сосед, о который он ударился, сам успел бы уйти с дороги
+std::vector<int> fast_balls;
+std::vector<char> fast_flag;
+// отдельная сетка по заметённым прямоугольникам быстрых шаров: шар лежит во всех ячейках своего пути
+std::vector<int> fast_cell_start;
+std::vector<int> fast_cell_balls;
+std::vector<int> fast_cell_fill;
+int fast_cols = 0, fast_rows = 0;
+float fast_min_x = 0, fast_min_y = 0, fast_cell_size = 1;
+
+// visit(j) для шаров, чьи центры на момент построения broad phase могут лежать в [min, max]
+template <class Visit>
+void for_each_ball_near(float min_x, float min_y, float max_x, float max_y, Visit visit) {
+    if (BROAD_PHASE == BROAD_PHASE_GRID) {
+        int x0 = std::max(0, (int)((min_x - grid_min_x) / grid_cell_size));
+        int y0 = std::max(0, (int)((min_y - grid_min_y) / grid_cell_size));
+        int x1 = std::min(grid_cols - 1, (int)((max_x - grid_min_x) / grid_cell_size));
+        int y1 = std::min(grid_rows - 1, (int)((max_y - grid_min_y) / grid_cell_size));
+        for (int cy = y0; cy <= y1; ++cy)
+            for (int cx = x0; cx <= x1; ++cx)
+                for (int k = grid_cell_start[cy * grid_cols + cx]; k < grid_cell_start[cy * grid_cols + cx + 1]; ++k)
+                    visit(grid_cell_balls[k]);
+        return;
+    }
+    // sweep: левые края отсортированы, центр в [min_x, max_x] — край в [min_x - r, max_x]
+    auto begin = std::lower_bound(sweep_min_x.begin(), sweep_min_x.end(), min_x - (MIN_SIZE + MAX_SIZE));
+    for (auto it = begin; it != sweep_min_x.end() && *it <= max_x; ++it) {
+        int k = (int)(it - sweep_min_x.begin());
+        if (sweep_y[k] >= min_y && sweep_y[k] <= max_y)
+            visit(sweep_order[k]);
+    }
+}
+
+// Первое касание двух кругов, движущихся равномерно: |p + t v| = r, t в [0, 1).
+// p — разность начальных центров, v — разность смещений. Уже касающиеся на старте
+// сближаться не должны вовсе — для них t = 0
+inline bool circles_time_of_impact(float px, float py, float vx, float vy, float r, float& t) {
+    float a = vx * vx + vy * vy;
+    float b = px * vx + py * vy;
+    float c = px * px + py * py - r * r;
+    if (b >= 0.0f || a < 1e-6f)
+        return false;
+    if (c <= 0.0f) {
+        t = 0.0f;
+        return px * px + py * py > 1e-6f;
+    }
+    float disc = b * b - a * c;
+    if (disc < 0.0f)
+        return false;
+    t = (-b - sqrtf(disc)) / a;
+    return t < 1.0f;
+}
+
+// Круг из from по motion упирается в ребро ab, сдвинутое на radius вдоль нормали n
+// (n смотрит туда, откуда приходит шар). Касание засчитывается, только если проекция
+// центра попала на само ребро — иначе первым встретится закругление у вершины
+inline void edge_time_of_impact(Vec2 from, Vec2 motion, float radius, Vec2 a, Vec2 b, Vec2 n, float& t_hit, Vec2& normal) {
+    float ex = b.x - a.x, ey = b.y - a.y;
+    float len2 = ex * ex + ey * ey;
+    float d0 = (from.x - a.x) * n.x + (from.y - a.y) * n.y;
+    float dn = motion.x * n.x + motion.y * n.y;
+    if (len2 <= 0.0f || d0 < radius || dn >= 0.0f)
+        return;
+    float t = (d0 - radius) / -dn;
+    if (t >= t_hit)
+        return;
+    float u = ((from.x + motion.x * t - a.x) * ex + (from.y + motion.y * t - a.y) * ey) / len2;
+    if (u >= 0.0f && u <= 1.0f) {
+        t_hit = t;
+        normal = n;
+    }
+}
+
+inline void vertex_time_of_impact(Vec2 from, Vec2 motion, float radius, Vec2 v, float& t_hit, Vec2& normal) {
+    float t;
+    float rel_x = from.x - v.x, rel_y = from.y - v.y;
+    if (circles_time_of_impact(rel_x, rel_y, motion.x, motion.y, radius, t) && t < t_hit) {
+        t_hit = t;
+        float cx = rel_x + motion.x * t, cy = rel_y + motion.y * t;
+        float len = sqrtf(cx * cx + cy * cy);
+        normal = len > 0.0f ? Vec2(cx / len, cy / len) : Vec2(-motion.x, -motion.y);
+    }
+}
+
+// Точный момент касания с выпуклым коллайдером: сумма Минковского коллайдера и круга —
+// рёбра, сдвинутые на radius, и круги у вершин, первое касание — самое раннее из них.
+// Шаги по расстоянию (conservative advancement) при скользящем подлёте не успевали
+// дойти до поверхности за разумное число итераций, и шар проходил насквозь
+bool collider_time_of_impact(const StaticCollider& c, Vec2 from, Vec2 motion, float radius, float& t, Vec2& normal) {
+    Vec2 n;
+    if (collider_distance(c, from, n) <= radius) {
+        t = 0.0f;
+        normal = n;
+        return motion.x * n.x + motion.y * n.y < 0.0f;
+    }
+    const Vec2* v = static_vertices.data() + c.first;
+    t = 1.0f;
+    if (c.shape == COLLIDER_SEGMENT) {
+        // у отрезка две стороны — берём ту, где шар сейчас
+        float ex = v[1].x - v[0].x, ey = v[1].y - v[0].y;
+        float len = sqrtf(ex * ex + ey * ey);
+        if (len > 0.0f) {
+            Vec2 side(ey / len, -ex / len);
+            if ((from.x - v[0].x) * side.x + (from.y - v[0].y) * side.y < 0.0f)
+                side = Vec2(-side.x, -side.y);
+            edge_time_of_impact(from, motion, radius, v[0], v[1], side, t, normal);
+        }
+        vertex_time_of_impact(from, motion, radius, v[0], t, normal);
+        vertex_time_of_impact(from, motion, radius, v[1], t, normal);
+    } else {
+        for (int k = 0; k < c.count; ++k) {
+            edge_time_of_impact(from, motion, radius, v[k], v[(k + 1) % c.count], static_normals[c.first + k], t, normal);
+            vertex_time_of_impact(from, motion, radius, v[k], t, normal);
+        }
+    }
+    return t < 1.0f;
+}
+
+// Момент первого касания i с j на этом подшаге, если он раньше t_hit
+inline void ball_time_of_impact(int i, int j, float& t_hit, Vec2& normal) {
+    const float* x = balls.x.data();
+    const float* y = balls.y.data();
+    const float* px = balls.prev_x.data();
+    const float* py = balls.prev_y.data();
+    float t;
+    float rel_x = px[i] - px[j], rel_y = py[i] - py[j];
+    float vx = (x[i] - px[i]) - (x[j] - px[j]), vy = (y[i] - py[i]) - (y[j] - py[j]);
+    if (circles_time_of_impact(rel_x, rel_y, vx, vy, balls.radius[i] + balls.radius[j], t) && t < t_hit) {
+        t_hit = t;
+        float cx = rel_x + vx * t, cy = rel_y + vy * t;
+        float len = sqrtf(cx * cx + cy * cy);
+        normal = Vec2(cx / len, cy / len);
+    }
+}
+
+// Срезает с хвоста пути и со скорости составляющую, идущую внутрь контакта по normal
+inline void stop_sliding_into(int i, Vec2 normal, float& slide_x, float& slide_y) {
+    float into = slide_x * normal.x + slide_y * normal.y;
+    if (into >= 0.0f)
+        return;
+    slide_x -= normal.x * into;
+    slide_y -= normal.y * into;
+    float vn = balls.vel_x[i] * normal.x + balls.vel_y[i] * normal.y;
+    if (vn < 0.0f) {
+        balls.vel_x[i] -= normal.x * vn;
+        balls.vel_y[i] -= normal.y * vn;
+    }
+}
+
+// Путь каждого быстрого шара, расширенный на наибольший радиус, раскладывается по ячейкам;
+// два пути, которые могут дать касание, так всегда делят ячейку
+void build_fast_grid() {
+    const float* x = balls.x.data();
+    const float* y = balls.y.data();
+    const float* px = balls.prev_x.data();
+    const float* py = balls.prev_y.data();
+    float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+    for (int i : fast_balls) {
+        min_x = std::min(min_x, std::min(px[i], x[i]));
+        min_y = std::min(min_y, std::min(py[i], y[i]));
+        max_x = std::max(max_x, std::max(px[i], x[i]));
+        max_y = std::max(max_y, std::max(py[i], y[i]));
+    }
+    const float pad = (float)(MIN_SIZE + MAX_SIZE);   // радиус не больше, см. random_ball
+    fast_min_x = min_x - pad;
+    fast_min_y = min_y - pad;
+    // ячеек не больше, чем вчетверо против числа шаров
+    fast_cell_size = 2.0f * (MIN_SIZE + MAX_SIZE);
+    for (;;) {
+        fast_cols = (int)((max_x + pad - fast_min_x) / fast_cell_size) + 1;
+        fast_rows = (int)((max_y + pad - fast_min_y) / fast_cell_size) + 1;
+        if ((long long)fast_cols * fast_rows <= 4 * (long long)fast_balls.size() + 16)
+            break;
+        fast_cell_size *= 2.0f;
+    }
+
+    fast_cell_start.assign(fast_cols * fast_rows + 1, 0);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i : fast_balls) {
+            int x0 = (int)((std::min(px[i], x[i]) - pad - fast_min_x) / fast_cell_size);
+            int y0 = (int)((std::min(py[i], y[i]) - pad - fast_min_y) / fast_cell_size);
+            int x1 = (int)((std::max(px[i], x[i]) + pad - fast_min_x) / fast_cell_size);
+            int y1 = (int)((std::max(py[i], y[i]) + pad - fast_min_y) / fast_cell_size);
+            for (int cy = y0; cy <= y1; ++cy)
+                for (int cx = x0; cx <= x1; ++cx) {
+                    if (pass == 0)
+                        ++fast_cell_start[cy * fast_cols + cx + 1];
+                    else
+                        fast_cell_balls[fast_cell_fill[cy * fast_cols + cx]++] = i;
+                }
+        }
+        if (pass == 0) {
+            for (int c = 0; c < fast_cols * fast_rows; ++c)
+                fast_cell_start[c + 1] += fast_cell_start[c];
+            fast_cell_balls.resize(fast_cell_start.back());
+            fast_cell_fill.assign(fast_cell_start.begin(), fast_cell_start.end() - 1);
+        }
+    }
+}
+
+// Возвращает, сколько шаров остановлено; тогда broad phase надо перестроить
+int sweep_fast_balls() {
+    float* x = balls.x.data();
+    float* y = balls.y.data();
+    const float* px = balls.prev_x.data();
+    const float* py = balls.prev_y.data();
+    const float* radius = balls.radius.data();
+    int n = balls.size();
+    const float fast2 = (float)(MIN_SIZE * MIN_SIZE);
+
+    fast_balls.clear();
+    fast_flag.assign(n, 0);
+    for (int i = 0; i < n; ++i) {
+        if (balls.asleep[i])
+            continue;
+        float dx = x[i] - px[i], dy = y[i] - py[i];
+        if (dx * dx + dy * dy > fast2) {
+            fast_balls.push_back(i);
+            fast_flag[i] = 1;
+        }
+    }
+    stat_fast_balls = (int)fast_balls.size();
+    stat_swept_hits = 0;
+    total_fast_balls += stat_fast_balls;
+    if (fast_balls.empty())
+        return 0;
+
+    // быстрые друг против друга — по своей сетке: запас на чужой путь в общем индексе
+    // захватил бы полмира
+    build_fast_grid();
+
+    // касание — на сумме радиусов, а медленный сосед за подшаг уходит от своей ячейки
+    // не дальше MIN_SIZE
+    const float max_radius = (float)(MIN_SIZE + MAX_SIZE);
+    const float reach = 2.0f * max_radius + MIN_SIZE;
+    int hits = 0;
+    // второй проход — против уже остановленных, их путь стал короче
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t k = 0; k < fast_balls.size(); ++k) {
+            int i = fast_balls[k];
+            float dx = x[i] - px[i], dy = y[i] - py[i];
+            if (dx * dx + dy * dy <= fast2)
+                continue;
+            float t_hit = 1.0f;
+            Vec2 normal;
+            float lo_x = std::min(px[i], x[i]), hi_x = std::max(px[i], x[i]);
+            float lo_y = std::min(py[i], y[i]), hi_y = std::max(py[i], y[i]);
+
+            for_each_ball_near(lo_x - reach, lo_y - reach, hi_x + reach, hi_y + reach, [&](int j) {
+                if (!fast_flag[j])
+                    ball_time_of_impact(i, j, t_hit, normal);
+            });
+            int x0 = std::max(0, (int)((lo_x - max_radius - fast_min_x) / fast_cell_size));
+            int y0 = std::max(0, (int)((lo_y - max_radius - fast_min_y) / fast_cell_size));
+            int x1 = std::min(fast_cols - 1, (int)((hi_x + max_radius - fast_min_x) / fast_cell_size));
+            int y1 = std::min(fast_rows - 1, (int)((hi_y + max_radius - fast_min_y) / fast_cell_size));
+            for (int cy = y0; cy <= y1; ++cy)
+                for (int cx = x0; cx <= x1; ++cx)
+                    for (int k = fast_cell_start[cy * fast_cols + cx]; k < fast_cell_start[cy * fast_cols + cx + 1]; ++k) {
+                        // пара может встретиться в нескольких общих ячейках — момент от этого не меняется
+                        int j = fast_cell_balls[k];
+                        if (j != i)
+                            ball_time_of_impact(i, j, t_hit, normal);
+                    }
+            query_bvh(lo_x - radius[i], lo_y - radius[i], hi_x + radius[i], hi_y + radius[i], [&](int c) {
+                float t;
+                Vec2 n;
+                if (collider_time_of_impact(static_colliders[c], Vec2(px[i], py[i]), Vec2(dx, dy), radius[i], t, n) && t < t_hit) {
+                    t_hit = t;
+                    normal = n;
+                }
+            });
+            if (t_hit >= 1.0f)
+                continue;
+
+            // до касания, дальше — только касательная часть остатка. Скорость теряет ту же
+            // составляющую (неупругий удар), иначе следующий подшаг снова понесёт шар внутрь;
+            // путь для второго прохода — этот касательный хвост
+            float slide_x = dx, slide_y = dy;
+            stop_sliding_into(i, normal, slide_x, slide_y);
+            // касательная к шару может смотреть в статику, которой шар касается в той же точке,
+            // а второй проход не проверяет собственный хвост — её нормали срезаем сразу
+            float hit_x = px[i] + dx * t_hit, hit_y = py[i] + dy * t_hit;
+            float reach_static = radius[i] + CONTACT_MARGIN;
+            query_bvh(hit_x - reach_static, hit_y - reach_static, hit_x + reach_static, hit_y + reach_static, [&](int c) {
+                Vec2 n;
+                if (collider_distance(static_colliders[c], Vec2(hit_x, hit_y), n) < reach_static)
+                    stop_sliding_into(i, n, slide_x, slide_y);
+            });
+            // две стенки углом: вторая срезка могла вернуть движение в первую
+            if (slide_x * normal.x + slide_y * normal.y < 0.0f)
+                slide_x = slide_y = 0.0f;
+            x[i] = hit_x + slide_x * (1.0f - t_hit);
+            y[i] = hit_y + slide_y * (1.0f - t_hit);
+            balls.prev_x[i] = x[i] - slide_x;
+            balls.prev_y[i] = y[i] - slide_y;
+            if (pass == 0)
+                ++hits;
+        }
+    }
+    stat_swept_hits = hits;
+    total_swept_hits += hits;
+    return hits;
+}
+
+// Возвращает ссылку на переиспользуемый буфер — он валиден до следующего вызова
+std::vector<BallPair>& detect_collisions() {
+    std::fill(balls.colliding.begin(), balls.colliding.end(), 0);
+    contact_pairs.clear();
+
+    {
+        PROFILE_PHASE(PHASE_BROAD);
+        broad_phase();
+        // остановленные шары ушли из своих ячеек — индекс строим заново
+        if (CONTINUOUS_COLLISION && sweep_fast_balls() > 0)
+            broad_phase();
+    }
+
+    PROFILE_PHASE(PHASE_NARROW);
+    collect_contacts();
+    stat_contacts = (int)contact_pairs.size();
+    collect_static_contacts();
+
+    return contact_pairs;
+}
+
+void resolve_collisions_naive_iterative(const std::vector<BallPair>& pairs, int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+        for (const BallPair& pair : pairs) {
+            SDL_FPoint diff = {balls.x[pair.b] - balls.x[pair.a], balls.y[pair.b] - balls.y[pair.a]};
+            float dist_sq = diff.x * diff.x + diff.y * diff.y;
+            float min_dist = balls.radius[pair.a] + balls.radius[pair.b];
+
+            if (dist_sq == 0.0f) {
+                diff = {1.0f, 0.0f};
+                dist_sq = 1.0f;
+            }
+
+            float dist = sqrtf(dist_sq);
+            float overlap = min_dist - dist;
+
+            if (overlap > 0.0f) {
+                SDL_FPoint n = {diff.x / dist, diff.y / dist};
+                float move = overlap * 0.5f;
+
+                balls.x[pair.a] -= n.x * move;
+                balls.y[pair.a] -= n.y * move;
+                balls.x[pair.b] += n.x * move;
+                balls.y[pair.b] += n.y * move;
+
+                float v_rel = (balls.vel_x[pair.b] - balls.vel_x[pair.a]) * n.x + (balls.vel_y[pair.b] - balls.vel_y[pair.a]) * n.y;
+                if (v_rel < 0.0f) {
+                    float impulse = -v_rel;
+                    balls.vel_x[pair.a] -= n.x * impulse;
+                    balls.vel_y[pair.a] -= n.y * impulse;
+                    balls.vel_x[pair.b] += n.x * impulse;
+                    balls.vel_y[pair.b] += n.y * impulse;
+                }
+            }
+        }
+    }
+}
+
+void resolve_collisions_impulse(const std::vector<BallPair>& pairs, int iterations) {
+    for (int iter = 0; iter < iterations; ++iter) {
+        for (const BallPair& pair : pairs) {
+Vec2 pos_a(balls.x[pair.a], balls.y[pair.a]);
+            Vec2 pos_b(balls.x[pair.b], balls.y[pair.b]);
+
+            Vec2 delta = pos_b - pos_a;
+            float dist_sq = delta.length_squared();
+            float radius_sum = balls.radius[pair.a] + balls.radius[pair.b];
 
             if (dist_sq == 0.0f) {
                 delta = Vec2(1.0f, 0.0f);
@@ -560,14 +3594,14 @@ Vec2 pos_a(a.pos.x, a.pos.y);
 
                 // Раздвигаем шары поровну
                 Vec2 correction = normal * (penetration * 0.5f);
-                a.pos.x -= correction.x;
-                a.pos.y -= correction.y;
-                b.pos.x += correction.x;
-                b.pos.y += correction.y;
+                balls.x[pair.a] -= correction.x;
+                balls.y[pair.a] -= correction.y;
+                balls.x[pair.b] += correction.x;
+                balls.y[pair.b] += correction.y;
 
                 // Скорости
-                Vec2 vel_a(a.vel.x, a.vel.y);
-                Vec2 vel_b(b.vel.x, b.vel.y);
+                Vec2 vel_a(balls.vel_x[pair.a], balls.vel_y[pair.a]);
+                Vec2 vel_b(balls.vel_x[pair.b], balls.vel_y[pair.b]);
 
                 // Относительная скорость вдоль нормали
                 float rel_vel = (vel_b - vel_a).dot(normal);
@@ -577,11 +3611,11 @@ Vec2 pos_a(a.pos.x, a.pos.y);
 
                     Vec2 impulse_vec = normal * impulse;
 
-                    a.vel.x -= impulse_vec.x;
-                    a.vel.y -= impulse_vec.y;
+                    balls.vel_x[pair.a] -= impulse_vec.x;
+                    balls.vel_y[pair.a] -= impulse_vec.y;
 
-                    b.vel.x += impulse_vec.x;
-                    b.vel.y += impulse_vec.y;
+                    balls.vel_x[pair.b] += impulse_vec.x;
+                    balls.vel_y[pair.b] += impulse_vec.y;
                 }
             }
         }
@@ -597,12 +3631,9 @@ void resolve_collisions_impulse_baumgarte(const std::vector<BallPair>& pairs, in
         float baumgarte_coef = baumgarte_base * (1.0f - float(i) / float(iterations));
 
         for (const BallPair& pair : pairs) {
-            Ball& a = balls[pair.a];
-            Ball& b = balls[pair.b];
-
-            SDL_FPoint diff = {b.pos.x - a.pos.x, b.pos.y - a.pos.y};
+            SDL_FPoint diff = {balls.x[pair.b] - balls.x[pair.a], balls.y[pair.b] - balls.y[pair.a]};
             float dist_sq = diff.x * diff.x + diff.y * diff.y;
-            float min_dist = a.radius + b.radius;
+            float min_dist = balls.radius[pair.a] + balls.radius[pair.b];
 
             if (dist_sq == 0.0f) {
                 diff = {1.0f, 0.0f};
@@ -618,83 +3649,2711 @@ void resolve_collisions_impulse_baumgarte(const std::vector<BallPair>& pairs, in
                 // Baumgarte positional correction (мягко подгоняем позиции)
                 float baumgarte_correction = baumgarte_coef * penetration;
 
-                a.pos.x -= n.x * baumgarte_correction * 0.5f;
-                a.pos.y -= n.y * baumgarte_correction * 0.5f;
-                b.pos.x += n.x * baumgarte_correction * 0.5f;
-                b.pos.y += n.y * baumgarte_correction * 0.5f;
+                balls.x[pair.a] -= n.x * baumgarte_correction * 0.5f;
+                balls.y[pair.a] -= n.y * baumgarte_correction * 0.5f;
+                balls.x[pair.b] += n.x * baumgarte_correction * 0.5f;
+                balls.y[pair.b] += n.y * baumgarte_correction * 0.5f;
 
                 // Импульсная коррекция скорости
-                float v_rel = (b.vel.x - a.vel.x) * n.x + (b.vel.y - a.vel.y) * n.y;
+                float v_rel = (balls.vel_x[pair.b] - balls.vel_x[pair.a]) * n.x + (balls.vel_y[pair.b] - balls.vel_y[pair.a]) * n.y;
                 if (v_rel < 0.0f) {
                     float impulse = -v_rel;
-                    a.vel.x -= n.x * impulse;
-                    a.vel.y -= n.y * impulse;
-                    b.vel.x += n.x * impulse;
-                    b.vel.y += n.y * impulse;
+                    balls.vel_x[pair.a] -= n.x * impulse;
+                    balls.vel_y[pair.a] -= n.y * impulse;
+                    balls.vel_x[pair.b] += n.x * impulse;
+                    balls.vel_y[pair.b] += n.y * impulse;
                 }
             }
         }
     }
 }
 
-void resolve_collisions_pbd(const std::vector<BallPair>& pairs, int iterations) {
-    for (int step = 0; step < iterations; ++step) {
-        for (const BallPair& pair : pairs) {
-            Ball& a = balls[pair.a];
-            Ball& b = balls[pair.b];
+// Контакты, раскрашенные в батчи: внутри одного батча шар встречается не больше раза,
+// поэтому контакты батча можно решать одновременно (SIMD) без конфликтов записи
+const int MAX_CONTACT_COLORS = 64;
 
-            Vec2 delta = {b.pos.x - a.pos.x, b.pos.y - a.pos.y};
-            float dist2 = delta.length_squared();
-            float r = a.radius + b.radius;
+struct ContactBatches {
+    std::vector<int> a, b;          // индексы шаров, отсортированы по батчам
+    aligned_vector<float> lambda;   // накопленная поправка контакта
+    std::vector<int> pair;          // номер контакта во входном списке
+    std::vector<Uint8> keep;        // пара ещё в активном наборе после прошлой итерации
+    std::vector<int> batch_start;   // MAX_CONTACT_COLORS + 1 батчей, последний — конфликтный
+};
 
-            if (dist2 < r * r && dist2 > 0.0001f) {
-                float dist = sqrt(dist2);
-                float penetration = r - dist;
-                Vec2 correction = delta * (0.5f * penetration / dist); // поровну
+ContactBatches contact_batches;
+std::vector<uint64_t> ball_color_mask;
+std::vector<int> pair_color;
+std::vector<int> batch_fill;
+
+void build_contact_batches(const std::vector<BallPair>& pairs) {
+    int m = (int)pairs.size();
+    ContactBatches& out = contact_batches;
+
+    ball_color_mask.assign(balls.size(), 0);
+    pair_color.resize(m);
+    out.batch_start.assign(MAX_CONTACT_COLORS + 2, 0);
+
+    // Жадная раскраска: первый цвет, не занятый ни одним из двух шаров.
+    // Если заняты все 64, контакт уходит в конфликтный батч и решается последовательно
+    for (int k = 0; k < m; ++k) {
+        int a = pairs[k].a;
+        int b = pairs[k].b;
+        uint64_t used = ball_color_mask[a] | ball_color_mask[b];
+        int color = MAX_CONTACT_COLORS;
+        if (~used) {
+            color = __builtin_ctzll(~used);
+            ball_color_mask[a] |= 1ull << color;
+            ball_color_mask[b] |= 1ull << color;
+        }
+        pair_color[k] = color;
+        out.batch_start[color + 1]++;
+    }
+
+    for (int c = 0; c <= MAX_CONTACT_COLORS; ++c)
+        out.batch_start[c + 1] += out.batch_start[c];
+
+    out.a.resize(m);
+    out.b.resize(m);
+    out.lambda.resize(m);
+    out.pair.resize(m);
+    out.keep.resize(m);
+    batch_fill.assign(out.batch_start.begin(), out.batch_start.end() - 1);
+    for (int k = 0; k < m; ++k) {
+        int slot = batch_fill[pair_color[k]]++;
+        out.a[slot] = pairs[k].a;
+        out.b[slot] = pairs[k].b;
+        out.lambda[slot] = pairs[k].lambda;
+        out.pair[slot] = k;
+    }
+}
+
+// Тёплый старт: сразу раздвигаем пары на поправку, накопленную на прошлом подшаге.
+// Перелёт потом забирается итерациями — лямбда может уменьшаться до нуля
+void warm_start_contacts(const int* ca, const int* cb, const float* lambda, int count) {
+    float* __restrict x = balls.x.data();
+    float* __restrict y = balls.y.data();
+
+    for (int k = 0; k < count; ++k) {
+        if (lambda[k] <= 0.0f)
+            continue;
+
+        int a = ca[k];
+        int b = cb[k];
+        Vec2 delta = {x[b] - x[a], y[b] - y[a]};
+        float dist2 = delta.length_squared();
+        if (dist2 <= 0.0001f)
+            continue;
+
+        float dist = sqrt(dist2);
+        Vec2 correction = delta * (0.5f * lambda[k] / dist);
+        x[a] -= correction.x;
+        y[a] -= correction.y;
+        x[b] += correction.x;
+        y[b] += correction.y;
+    }
+}
+
+// Проекция контакта с накопленной лямбдой: лямбда += проникновение, но не меньше нуля.
+// Пока контакт не разошёлся, это обычный PBD; если тёплый старт раздвинул пару
+// слишком сильно, поправка становится отрицательной и стягивает её обратно.
+// keep[k] = 0, если пара разошлась и не держит лямбду — на следующих итерациях её можно
+// не смотреть; max_penetration — наибольшее проникновение среди просмотренных пар
+void solve_contacts_scalar(const int* ca, const int* cb, float* lambda, Uint8* keep, int count, float& max_penetration) {
+    float* __restrict x = balls.x.data();
+    float* __restrict y = balls.y.data();
+    const float* __restrict radius = balls.radius.data();
+    float max_pen = max_penetration;
+
+    for (int k = 0; k < count; ++k) {
+        int a = ca[k];
+        int b = cb[k];
+
+        Vec2 delta = {x[b] - x[a], y[b] - y[a]};
+        float dist2 = delta.length_squared();
+        float r = radius[a] + radius[b];
+
+        if (dist2 <= 0.0001f || (dist2 >= r * r && lambda[k] <= 0.0f)) {
+            keep[k] = 0;
+            continue;
+        }
+        keep[k] = 1;
+
+        float dist = sqrt(dist2);
+        float penetration = r - dist;
+        max_pen = std::max(max_pen, penetration);
+        float new_lambda = std::max(lambda[k] + penetration, 0.0f);
+        float applied = new_lambda - lambda[k];
+        if (applied == 0.0f)
+            continue;
+
+        lambda[k] = new_lambda;
+        Vec2 correction = delta * (0.5f * applied / dist); // поровну
+
+        x[a] -= correction.x;
+        y[a] -= correction.y;
+        x[b] += correction.x;
+        y[b] += correction.y;
+    }
+    max_penetration = max_pen;
+}
 
-                a.pos.x -= correction.x;
-                a.pos.y -= correction.y;
-                b.pos.x += correction.x;
-                b.pos.y += correction.y;
+#if defined(__SSE2__)
+// 4 контакта за раз. Загрузка по индексам собирается вручную, запись обратно
+// поэлементная — в пределах батча индексы не повторяются
+int solve_contacts_sse(const int* ca, const int* cb, float* lambda, Uint8* keep, int count, float& max_penetration) {
+    float* x = balls.x.data();
+    float* y = balls.y.data();
+    const float* radius = balls.radius.data();
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 min_dist2 = _mm_set1_ps(0.0001f);
+    __m128 max_pen = _mm_set1_ps(max_penetration);
+    alignas(16) float out_ax[4], out_ay[4], out_bx[4], out_by[4];
+
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        const int* a = ca + k;
+        const int* b = cb + k;
+
+        __m128 ax = _mm_setr_ps(x[a[0]], x[a[1]], x[a[2]], x[a[3]]);
+        __m128 ay = _mm_setr_ps(y[a[0]], y[a[1]], y[a[2]], y[a[3]]);
+        __m128 ar = _mm_setr_ps(radius[a[0]], radius[a[1]], radius[a[2]], radius[a[3]]);
+        __m128 bx = _mm_setr_ps(x[b[0]], x[b[1]], x[b[2]], x[b[3]]);
+        __m128 by = _mm_setr_ps(y[b[0]], y[b[1]], y[b[2]], y[b[3]]);
+        __m128 br = _mm_setr_ps(radius[b[0]], radius[b[1]], radius[b[2]], radius[b[3]]);
+        __m128 lam = _mm_loadu_ps(lambda + k);
+
+        __m128 dx = _mm_sub_ps(bx, ax);
+        __m128 dy = _mm_sub_ps(by, ay);
+        __m128 dist2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 r = _mm_add_ps(ar, br);
+
+        __m128 touching = _mm_or_ps(_mm_cmplt_ps(dist2, _mm_mul_ps(r, r)), _mm_cmpgt_ps(lam, zero));
+        __m128 active = _mm_and_ps(touching, _mm_cmpgt_ps(dist2, min_dist2));
+        int active_bits = _mm_movemask_ps(active);
+        for (int l = 0; l < 4; ++l)
+            keep[k + l] = (active_bits >> l) & 1;
+        if (active_bits == 0)
+            continue; // уже разошлись — частый случай на поздних итерациях
+
+        __m128 dist = _mm_sqrt_ps(dist2);
+        __m128 penetration = _mm_sub_ps(r, dist);
+        max_pen = _mm_max_ps(max_pen, _mm_and_ps(active, penetration));
+        __m128 new_lambda = _mm_max_ps(_mm_add_ps(lam, penetration), zero);
+        __m128 applied = _mm_and_ps(active, _mm_sub_ps(new_lambda, lam));
+        __m128 scale = _mm_div_ps(_mm_mul_ps(half, applied), dist);
+        scale = _mm_and_ps(active, scale);
+
+        _mm_storeu_ps(lambda + k, _mm_or_ps(_mm_and_ps(active, new_lambda), _mm_andnot_ps(active, lam)));
+
+        __m128 cx = _mm_mul_ps(dx, scale);
+        __m128 cy = _mm_mul_ps(dy, scale);
+
+        _mm_store_ps(out_ax, _mm_sub_ps(ax, cx));
+        _mm_store_ps(out_ay, _mm_sub_ps(ay, cy));
+        _mm_store_ps(out_bx, _mm_add_ps(bx, cx));
+        _mm_store_ps(out_by, _mm_add_ps(by, cy));
+
+        for (int l = 0; l < 4; ++l) {
+            x[a[l]] = out_ax[l];
+            y[a[l]] = out_ay[l];
+            x[b[l]] = out_bx[l];
+            y[b[l]] = out_by[l];
+        }
+    }
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, max_pen);
+    max_penetration = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    return k;
+}
+
+// 8 контактов за раз через gather, собирается под AVX2 отдельно и выбирается в рантайме
+__attribute__((target("avx2")))
+int solve_contacts_avx2(const int* ca, const int* cb, float* lambda, Uint8* keep, int count, float& max_penetration) {
+    float* x = balls.x.data();
+    float* y = balls.y.data();
+    const float* radius = balls.radius.data();
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 min_dist2 = _mm256_set1_ps(0.0001f);
+    __m256 max_pen = _mm256_set1_ps(max_penetration);
+    alignas(32) float out_ax[8], out_ay[8], out_bx[8], out_by[8];
+
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        const int* a = ca + k;
+        const int* b = cb + k;
+        __m256i ia = _mm256_loadu_si256((const __m256i*)a);
+        __m256i ib = _mm256_loadu_si256((const __m256i*)b);
+
+        __m256 ax = _mm256_i32gather_ps(x, ia, 4);
+        __m256 ay = _mm256_i32gather_ps(y, ia, 4);
+        __m256 ar = _mm256_i32gather_ps(radius, ia, 4);
+        __m256 bx = _mm256_i32gather_ps(x, ib, 4);
+        __m256 by = _mm256_i32gather_ps(y, ib, 4);
+        __m256 br = _mm256_i32gather_ps(radius, ib, 4);
+        __m256 lam = _mm256_loadu_ps(lambda + k);
+
+        __m256 dx = _mm256_sub_ps(bx, ax);
+        __m256 dy = _mm256_sub_ps(by, ay);
+        __m256 dist2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 r = _mm256_add_ps(ar, br);
+
+        __m256 touching = _mm256_or_ps(_mm256_cmp_ps(dist2, _mm256_mul_ps(r, r), _CMP_LT_OQ),
+                                       _mm256_cmp_ps(lam, zero, _CMP_GT_OQ));
+        __m256 active = _mm256_and_ps(touching, _mm256_cmp_ps(dist2, min_dist2, _CMP_GT_OQ));
+        int active_bits = _mm256_movemask_ps(active);
+        for (int l = 0; l < 8; ++l)
+            keep[k + l] = (active_bits >> l) & 1;
+        if (active_bits == 0)
+            continue;
+
+        __m256 dist = _mm256_sqrt_ps(dist2);
+        __m256 penetration = _mm256_sub_ps(r, dist);
+        max_pen = _mm256_max_ps(max_pen, _mm256_and_ps(active, penetration));
+        __m256 new_lambda = _mm256_max_ps(_mm256_add_ps(lam, penetration), zero);
+        __m256 applied = _mm256_and_ps(active, _mm256_sub_ps(new_lambda, lam));
+        __m256 scale = _mm256_div_ps(_mm256_mul_ps(half, applied), dist);
+        scale = _mm256_and_ps(active, scale);
+
+        _mm256_storeu_ps(lambda + k, _mm256_blendv_ps(lam, new_lambda, active));
+
+        __m256 cx = _mm256_mul_ps(dx, scale);
+        __m256 cy = _mm256_mul_ps(dy, scale);
+
+        _mm256_store_ps(out_ax, _mm256_sub_ps(ax, cx));
+        _mm256_store_ps(out_ay, _mm256_sub_ps(ay, cy));
+        _mm256_store_ps(out_bx, _mm256_add_ps(bx, cx));
+        _mm256_store_ps(out_by, _mm256_add_ps(by, cy));
+
+        for (int l = 0; l < 8; ++l) {
+            x[a[l]] = out_ax[l];
+            y[a[l]] = out_ay[l];
+            x[b[l]] = out_bx[l];
+            y[b[l]] = out_by[l];
+        }
+    }
+
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, max_pen);
+    float result = lanes[0];
+    for (int l = 1; l < 8; ++l)
+        result = std::max(result, lanes[l]);
+    max_penetration = result;
+    return k;
+}
+
+bool cpu_has_avx2() {
+    static int has = -1;
+    if (has < 0) {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return has == 1;
+}
+#endif
+
+// Решает батч независимых контактов: векторная часть + скалярный хвост.
+// Возвращает наибольшее проникновение в батче (не меньше нуля)
+float solve_contact_batch(const int* ca, const int* cb, float* lambda, Uint8* keep, int count) {
+    float max_penetration = 0.0f;
+    int done = 0;
+#if defined(__SSE2__)
+    if (PBD_KERNEL == PBD_KERNEL_SIMD)
+        done = cpu_has_avx2() ? solve_contacts_avx2(ca, cb, lambda, keep, count, max_penetration)
+                              : solve_contacts_sse(ca, cb, lambda, keep, count, max_penetration);
+#endif
+    solve_contacts_scalar(ca + done, cb + done, lambda + done, keep + done, count - done, max_penetration);
+    return max_penetration;
+}
+
+void atomic_max(std::atomic<float>& target, float value) {
+    float current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
 
-                a.colliding = b.colliding = true;
+// Выкидывает из батчей пары, которые на последней итерации оказались разошедшимися
+// без лямбды. Порядок оставшихся не меняется, так что результат не зависит от потоков
+void drop_resolved_contacts(std::vector<BallPair>& pairs) {
+    ContactBatches& batches = contact_batches;
+    int write = 0;
+    int begin = 0;
+    for (int c = 0; c <= MAX_CONTACT_COLORS; ++c) {
+        int end = batches.batch_start[c + 1];
+        batches.batch_start[c] = write;
+        for (int s = begin; s < end; ++s) {
+            if (!batches.keep[s]) {
+                pairs[batches.pair[s]].lambda = 0.0f;
+                continue;
             }
+            batches.a[write] = batches.a[s];
+            batches.b[write] = batches.b[s];
+            batches.lambda[write] = batches.lambda[s];
+            batches.pair[write] = batches.pair[s];
+            ++write;
         }
+        begin = end;
     }
+    batches.batch_start[MAX_CONTACT_COLORS + 1] = write;
 }
 
-void explode_nearby_balls_velocity_based(Vec2 center, float radius, float strength, std::vector<Ball>& balls) {
-    for (auto& ball : balls) {
-        Vec2 pos(ball.pos.x, ball.pos.y);
-        Vec2 dir = pos - center;
+// Итерации идут, пока наибольшее проникновение за проход не станет меньше SOLVER_TOLERANCE,
+// но не больше iterations. Между проходами разошедшиеся пары выбывают из активного набора
+void resolve_collisions_pbd(std::vector<BallPair>& pairs, int iterations) {
+    build_contact_batches(pairs);
+
+    ContactBatches& batches = contact_batches;
+    bool parallel = SOLVER_MODE == SOLVER_PARALLEL_GS;
+    std::atomic<float> pass_max(0.0f);
+
+    // контакты батча независимы, поэтому делёж батча между потоками не меняет результат
+    std::function<void(int, int)> solve_job = [&pass_max](int begin, int end) {
+        ContactBatches& batches = contact_batches;
+        float max_penetration = solve_contact_batch(batches.a.data() + begin, batches.b.data() + begin,
+                                                    batches.lambda.data() + begin, batches.keep.data() + begin, end - begin);
+        atomic_max(pass_max, max_penetration);
+    };
+    std::function<void(int, int)> warm_job = [](int begin, int end) {
+        ContactBatches& batches = contact_batches;
+        warm_start_contacts(batches.a.data() + begin, batches.b.data() + begin, batches.lambda.data() + begin, end - begin);
+    };
+
+    int used = 0;
+    float residual = 0.0f;
+    // step == -1 — проход тёплого старта по тем же батчам
+    for (int step = -1; step < iterations; ++step) {
+        if (step > 0)
+            drop_resolved_contacts(pairs);
+
+        const std::function<void(int, int)>& job = step < 0 ? warm_job : solve_job;
+        pass_max.store(0.0f);
+        for (int c = 0; c < MAX_CONTACT_COLORS; ++c) {
+            int begin = batches.batch_start[c];
+            int end = batches.batch_start[c + 1];
+            if (begin >= end)
+                continue;
+            if (parallel)
+                thread_pool.parallel_for(begin, end, 256, job);
+            else
+                job(begin, end);
+        }
 
-        float dist2 = dir.length_squared();
-        if (dist2 < radius * radius && dist2 > 1e-4f) {
-            float dist = sqrtf(dist2);
-            Vec2 norm_dir = dir / dist;
-            float force = strength * (1.0f - dist / radius);
+        // конфликтный батч — строго по одному
+        int begin = batches.batch_start[MAX_CONTACT_COLORS];
+        int end = batches.batch_start[MAX_CONTACT_COLORS + 1];
+        if (step < 0) {
+            warm_start_contacts(batches.a.data() + begin, batches.b.data() + begin, batches.lambda.data() + begin, end - begin);
+            continue;
+        }
+        float conflict_max = 0.0f;
+        solve_contacts_scalar(batches.a.data() + begin, batches.b.data() + begin, batches.lambda.data() + begin,
+                              batches.keep.data() + begin, end - begin, conflict_max);
+        float static_max = solve_static_contacts(false);
+        // связи тел — тем же проходом после контактов: цепочка, которую раздвинул контакт,
+        // стягивается в этой же итерации
+        float constraint_max = solve_ball_constraints(parallel, 0.0f);
+
+        ++used;
+        residual = std::max(std::max(pass_max.load(), conflict_max), std::max(static_max, constraint_max));
+        if (residual < SOLVER_TOLERANCE)
+            break;
+    }
+
+    int active = batches.batch_start[MAX_CONTACT_COLORS + 1];
+    for (int s = 0; s < active; ++s)
+        pairs[batches.pair[s]].lambda = batches.lambda[s];
+
+    for (const BallPair& pair : pairs)
+        balls.colliding[pair.a] = balls.colliding[pair.b] = true;
+
+    record_solver_stats(used, residual);
+}
+
+// Кэш контактов между подшагами: ключ (a, b) -> накопленная лямбда. Хранится
+// отсортированным по ключу, поэтому сопоставление с новым списком — один проход слиянием
+struct ContactCache {
+    std::vector<uint64_t> keys;
+    std::vector<float> lambda;
+};
+
+ContactCache contact_cache;
+std::vector<uint64_t> contact_keys;
+std::vector<int> contact_order;
 
-            ball.vel.x += norm_dir.x * force;
-            ball.vel.y += norm_dir.y * force;
+uint64_t contact_key(int a, int b) {
+    if (a > b)
+        std::swap(a, b);
+    return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+}
+
+void clear_contact_cache() {
+    contact_cache.keys.clear();
+    contact_cache.lambda.clear();
+}
+
+// Переносит лямбды сохранившихся контактов в новый список (с коэффициентом WARM_START),
+// новые начинают с нуля, пропавшие выпадают
+void warm_start_from_cache(std::vector<BallPair>& pairs) {
+    int m = (int)pairs.size();
+    contact_keys.resize(m);
+    contact_order.resize(m);
+    for (int k = 0; k < m; ++k) {
+        contact_keys[k] = contact_key(pairs[k].a, pairs[k].b);
+        contact_order[k] = k;
+    }
+    std::sort(contact_order.begin(), contact_order.end(), [](int i, int j) { return contact_keys[i] < contact_keys[j]; });
+
+    int old_count = (int)contact_cache.keys.size();
+    int j = 0;
+    stat_contacts_kept = stat_contacts_added = stat_contacts_removed = 0;
+    for (int idx = 0; idx < m; ++idx) {
+        int k = contact_order[idx];
+        uint64_t key = contact_keys[k];
+        while (j < old_count && contact_cache.keys[j] < key) {
+            ++j;
+            ++stat_contacts_removed;
+        }
+        if (j < old_count && contact_cache.keys[j] == key) {
+            pairs[k].lambda = contact_cache.lambda[j] * WARM_START;
+            ++stat_contacts_kept;
+            ++j;
+        } else {
+            pairs[k].lambda = 0.0f;
+            ++stat_contacts_added;
         }
     }
+    stat_contacts_removed += old_count - j;
 }
 
-void explode_nearby_balls(Vec2 center, float radius, float strength, std::vector<Ball>& balls) {
-    for (auto& ball : balls) {
-        Vec2 pos = ball.pos;
-        Vec2 dir = pos - center;
+void store_contact_cache(const std::vector<BallPair>& pairs) {
+    int m = (int)pairs.size();
+    contact_cache.keys.resize(m);
+    contact_cache.lambda.resize(m);
+    for (int idx = 0; idx < m; ++idx) {
+        int k = contact_order[idx];
+        contact_cache.keys[idx] = contact_keys[k];
+        contact_cache.lambda[idx] = pairs[k].lambda;
+    }
+}
 
-        float dist2 = dir.length_squared();
-        if (dist2 < radius * radius && dist2 > 1e-4f) {
-            float dist = sqrtf(dist2);
-            Vec2 norm_dir = dir / dist;
-            float force = strength * (1.0f - dist / radius);
+// Якоби: все контакты считаются от одних и тех же позиций, поправки суммируются
+// по шарам в фиксированном порядке (CSR по шарам), так что результат не зависит от числа потоков
+std::vector<int> ball_contact_start;
+std::vector<int> ball_contact_list;   // номер контакта * 2 + (1, если шар — b)
+aligned_vector<float> contact_corr_x, contact_corr_y;
+
+void resolve_collisions_jacobi(std::vector<BallPair>& pairs, int iterations) {
+    int n = balls.size();
+    int m = (int)pairs.size();
+
+    ball_contact_start.assign(n + 1, 0);
+    for (const BallPair& pair : pairs) {
+        ball_contact_start[pair.a + 1]++;
+        ball_contact_start[pair.b + 1]++;
+    }
+    for (int i = 0; i < n; ++i)
+        ball_contact_start[i + 1] += ball_contact_start[i];
+
+    ball_contact_list.resize(2 * m);
+    batch_fill.assign(ball_contact_start.begin(), ball_contact_start.end() - 1);
+    for (int k = 0; k < m; ++k) {
+        ball_contact_list[batch_fill[pairs[k].a]++] = 2 * k;
+        ball_contact_list[batch_fill[pairs[k].b]++] = 2 * k + 1;
+    }
+
+    contact_corr_x.resize(m);
+    contact_corr_y.resize(m);
+
+    const BallPair* contacts = pairs.data();
+    std::atomic<float> pass_max(0.0f);
+    std::function<void(int, int)> compute_job = [contacts, &pass_max](int begin, int end) {
+        const float* x = balls.x.data();
+        const float* y = balls.y.data();
+        const float* radius = balls.radius.data();
+        float max_penetration = 0.0f;
+        for (int k = begin; k < end; ++k) {
+            int a = contacts[k].a;
+            int b = contacts[k].b;
+            float dx = x[b] - x[a];
+            float dy = y[b] - y[a];
+            float dist2 = dx * dx + dy * dy;
+            float r = radius[a] + radius[b];
+
+            float scale = 0.0f;
+            if (dist2 < r * r && dist2 > 0.0001f) {
+                float dist = sqrtf(dist2);
+                scale = 0.5f * (r - dist) / dist;
+                max_penetration = std::max(max_penetration, r - dist);
+            }
+            contact_corr_x[k] = dx * scale;
+            contact_corr_y[k] = dy * scale;
+        }
+        atomic_max(pass_max, max_penetration);
+    };
+
+    std::function<void(int, int)> apply_job = [](int begin, int end) {
+        float* x = balls.x.data();
+        float* y = balls.y.data();
+        for (int i = begin; i < end; ++i) {
+            float sum_x = 0.0f, sum_y = 0.0f;
+            int active = 0;
+            for (int k = ball_contact_start[i]; k < ball_contact_start[i + 1]; ++k) {
+                int entry = ball_contact_list[k];
+                int contact = entry >> 1;
+                float cx = contact_corr_x[contact];
+                float cy = contact_corr_y[contact];
+                if (cx == 0.0f && cy == 0.0f)
+                    continue;
+                // a отодвигается против нормали, b — вдоль
+                float sign = (entry & 1) ? 1.0f : -1.0f;
+                sum_x += sign * cx;
+                sum_y += sign * cy;
+                ++active;
+            }
+            if (active > 0) {
+                float k = JACOBI_RELAXATION / active;
+                x[i] += sum_x * k;
+                y[i] += sum_y * k;
+            }
+        }
+    };
+
+    int used = 0;
+    float residual = 0.0f;
+    // статика и связи тел (они по батчам, Гауссом-Зейделем) решаются после усреднённых поправок,
+    // их ошибка учитывается на следующей проверке
+    float static_max = std::max(solve_static_contacts(false), solve_ball_constraints(true, 0.0f));
+    for (int step = 0; step < iterations; ++step) {
+        pass_max.store(0.0f);
+        thread_pool.parallel_for(0, m, 1024, compute_job);
+        residual = std::max(pass_max.load(), static_max);
+        if (residual < SOLVER_TOLERANCE)
+            break;
+        thread_pool.parallel_for(0, n, 1024, apply_job);
+        static_max = std::max(solve_static_contacts(false), solve_ball_constraints(true, 0.0f));
+        ++used;
+    }
+    record_solver_stats(used, residual);
+
+    // усреднённые поправки не раскладываются на лямбды контактов — тёплого старта у Якоби нет
+    for (BallPair& pair : pairs) {
+        pair.lambda = 0.0f;
+        balls.colliding[pair.a] = balls.colliding[pair.b] = true;
+    }
+}
+
+// Загрузка сцены, BVH и контакты шаров со статикой
+void build_bvh_node(int node, int begin, int end, int depth) {
+    BvhNode& n = bvh_nodes[node];
+    n.min_x = n.min_y = INFINITY;
+    n.max_x = n.max_y = -INFINITY;
+    for (int i = begin; i < end; ++i) {
+        const StaticCollider& c = static_colliders[i];
+        n.min_x = std::min(n.min_x, c.min_x);
+        n.min_y = std::min(n.min_y, c.min_y);
+        n.max_x = std::max(n.max_x, c.max_x);
+        n.max_y = std::max(n.max_y, c.max_y);
+    }
+    if (end - begin <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1) {
+        n.first = begin;
+        n.count = end - begin;
+        return;
+    }
+
+    // делим по медиане центров вдоль длинной стороны рамки
+    bool split_x = n.max_x - n.min_x >= n.max_y - n.min_y;
+    int mid = (begin + end) / 2;
+    std::nth_element(static_colliders.begin() + begin, static_colliders.begin() + mid, static_colliders.begin() + end,
+                     [split_x](const StaticCollider& a, const StaticCollider& b) {
+                         return split_x ? a.min_x + a.max_x < b.min_x + b.max_x : a.min_y + a.max_y < b.min_y + b.max_y;
+                     });
+
+    int left = (int)bvh_nodes.size();
+    n.first = left;
+    n.count = 0;
+    // n больше не трогаем: push_back может переложить массив
+    bvh_nodes.push_back(BvhNode());
+    bvh_nodes.push_back(BvhNode());
+    build_bvh_node(left, begin, mid, depth + 1);
+    build_bvh_node(left + 1, mid, end, depth + 1);
+}
+
+void build_bvh() {
+    bvh_nodes.clear();
+    if (static_colliders.empty())
+        return;
+    bvh_nodes.reserve(2 * static_colliders.size());
+    bvh_nodes.push_back(BvhNode());
+    build_bvh_node(0, 0, (int)static_colliders.size(), 0);
+}
+
+// Расстояние от точки до отрезка; normal — единичный вектор от ближайшей точки к p
+float segment_distance(Vec2 p, Vec2 a, Vec2 b, Vec2& normal) {
+    float ex = b.x - a.x, ey = b.y - a.y;
+    float len2 = ex * ex + ey * ey;
+    float t = len2 > 0.0f ? ((p.x - a.x) * ex + (p.y - a.y) * ey) / len2 : 0.0f;
+    t = std::min(std::max(t, 0.0f), 1.0f);
+    float dx = p.x - (a.x + ex * t);
+    float dy = p.y - (a.y + ey * t);
+    float dist = sqrtf(dx * dx + dy * dy);
+    if (dist > 0.0001f) {
+        normal = Vec2(dx / dist, dy / dist);
+    } else {
+        // центр ровно на отрезке — выталкиваем по перпендикуляру
+        float len = sqrtf(len2);
+        normal = len > 0.0f ? Vec2(ey / len, -ex / len) : Vec2(0.0f, -1.0f);
+    }
+    return dist;
+}
+
+// Знаковое расстояние от точки до коллайдера (внутри многоугольника — отрицательное)
+float collider_distance(const StaticCollider& c, Vec2 p, Vec2& normal) {
+    const Vec2* v = static_vertices.data() + c.first;
+    if (c.shape == COLLIDER_SEGMENT)
+        return segment_distance(p, v[0], v[1], normal);
+
+    const Vec2* edge_normal = static_normals.data() + c.first;
+    int best = 0;
+    float best_separation = -INFINITY;
+    for (int k = 0; k < c.count; ++k) {
+        float separation = (p.x - v[k].x) * edge_normal[k].x + (p.y - v[k].y) * edge_normal[k].y;
+        if (separation > best_separation) {
+            best_separation = separation;
+            best = k;
+        }
+    }
+    // внутри — выходим через ближайшее ребро
+    if (best_separation <= 0.0f) {
+        normal = edge_normal[best];
+        return best_separation;
+    }
+
+    float dist = INFINITY;
+    for (int k = 0; k < c.count; ++k) {
+        Vec2 edge_n;
+        float d = segment_distance(p, v[k], v[(k + 1) % c.count], edge_n);
+        if (d < dist) {
+            dist = d;
+            normal = edge_n;
+        }
+    }
+    return dist;
+}
+
+bool overlaps_static_geometry(float x, float y, float radius) {
+    bool hit = false;
+    query_bvh(x - radius, y - radius, x + radius, y + radius, [&](int i) {
+        Vec2 normal;
+        if (collider_distance(static_colliders[i], Vec2(x, y), normal) < radius)
+            hit = true;
+    });
+    return hit;
+}
+
+void add_static_collider(int shape, const std::vector<Vec2>& points) {
+    StaticCollider c;
+    c.shape = shape;
+    c.first = (int)static_vertices.size();
+    c.count = (int)points.size();
+    c.min_x = c.min_y = INFINITY;
+    c.max_x = c.max_y = -INFINITY;
+    for (const Vec2& p : points) {
+        c.min_x = std::min(c.min_x, p.x);
+        c.min_y = std::min(c.min_y, p.y);
+        c.max_x = std::max(c.max_x, p.x);
+        c.max_y = std::max(c.max_y, p.y);
+        static_vertices.push_back(p);
+        static_normals.push_back(Vec2());
+    }
+    if (shape == COLLIDER_POLYGON) {
+        for (int k = 0; k < c.count; ++k) {
+            Vec2 a = points[k];
+            Vec2 b = points[(k + 1) % c.count];
+            float len = sqrtf((b.x - a.x) * (b.x - a.x) + (b.y - a.y) * (b.y - a.y));
+            static_normals[c.first + k] = Vec2((b.y - a.y) / len, -(b.x - a.x) / len);
+        }
+    }
+    static_colliders.push_back(c);
+}
+
+// Площадь со знаком; у обхода по часовой стрелке на экране (y вниз) она положительна
+float polygon_area(const std::vector<Vec2>& points) {
+    float area = 0.0f;
+    for (size_t k = 0; k < points.size(); ++k) {
+        const Vec2& a = points[k];
+        const Vec2& b = points[(k + 1) % points.size()];
+        area += a.x * b.y - b.x * a.y;
+    }
+    return area * 0.5f;
+}
+
+// Меньше этого ребро или площадь считаем вырожденными: нормаль такого ребра — 0/0
+const float MIN_POLYGON_EDGE = 0.01f;
+const float MIN_POLYGON_AREA = 0.01f;
 
-            // Напрямую сдвигаем prev_pos в противоположную сторону
-            // чтобы при следующем шаге Verlet получился "пинок"
-            ball.prev_pos.x -= norm_dir.x * force;
-            ball.prev_pos.y -= norm_dir.y * force;
+bool polygon_is_degenerate(const std::vector<Vec2>& points) {
+    for (size_t k = 0; k < points.size(); ++k) {
+        const Vec2& a = points[k];
+        const Vec2& b = points[(k + 1) % points.size()];
+        if ((b.x - a.x) * (b.x - a.x) + (b.y - a.y) * (b.y - a.y) < MIN_POLYGON_EDGE * MIN_POLYGON_EDGE)
+            return true;
+    }
+    return fabsf(polygon_area(points)) < MIN_POLYGON_AREA;
+}
+
+bool polygon_is_convex(const std::vector<Vec2>& points) {
+    size_t n = points.size();
+    for (size_t k = 0; k < n; ++k) {
+        const Vec2& a = points[k];
+        const Vec2& b = points[(k + 1) % n];
+        const Vec2& c = points[(k + 2) % n];
+        if ((b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x) < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+// Расстояние между соседними шарами тела. Радиус шаров меньше его половины на CONTACT_MARGIN:
+// в покое соседи по связи не попадают в контакты и держатся только связью
+float body_spacing(const SceneBody& body) {
+    if (body.shape == BODY_CHAIN) {
+        float dx = body.end.x - body.origin.x;
+        float dy = body.end.y - body.origin.y;
+        return sqrtf(dx * dx + dy * dy) / std::max(1, body.cols - 1);
+    }
+    if (body.shape == BODY_CLOTH)
+        return body.size;
+    return 2.0f * body.size * sinf((float)M_PI / std::max(3, body.cols));
+}
+
+int body_ball_count(const SceneBody& body) {
+    return body.shape == BODY_CLOTH ? body.cols * body.rows : body.cols;
+}
+
+bool add_scene_body(const SceneBody& body, const char* path, int line_number) {
+    int min_count = body.shape == BODY_CHAIN ? 2 : (body.shape == BODY_RING ? 3 : 1);
+    if (body.cols < min_count || body.rows < 1) {
+        SDL_Log("Scene %s:%d: a chain needs 2 balls, a ring 3, a cloth 1x1", path, line_number);
+        return false;
+    }
+    float spacing = body_spacing(body);
+    float min_spacing = 2.0f * (MIN_SIZE + CONTACT_MARGIN);
+    if (spacing < min_spacing) {
+        SDL_Log("Scene %s:%d: balls are %.1f px apart, at least %.1f needed", path, line_number, spacing, min_spacing);
+        return false;
+    }
+    scene_bodies.push_back(body);
+    return true;
+}
+
+// Формат — по фигуре на строку, координаты мира, # — комментарий:
+//   segment x0 y0 x1 y1
+//   polygon x0 y0 x1 y1 x2 y2 ...   (выпуклый, обход любой)
+//   emitter x y vx vy rate [width [spread [limit]]]  (см. Emitter; spread в радианах)
+//   killzone x0 y0 x1 y1            (шары, чей центр попал в прямоугольник, удаляются)
+//   chain x0 y0 x1 y1 count [compliance]       (см. SceneBody; compliance — податливость связей)
+//   cloth x y cols rows spacing [compliance]
+//   ring x y radius count [compliance]        (обод жёсткий, податливы распорки)
+//   pin x y                         (закрепляет ближайший шар тел в его начальной точке)
+bool load_scene(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        SDL_Log("Cannot open scene %s", path);
+        return false;
+    }
+
+    static_colliders.clear();
+    static_vertices.clear();
+    static_normals.clear();
+    emitters.clear();
+    kill_zones.clear();
+    scene_bodies.clear();
+    scene_pins.clear();
+
+    char line[4096];
+    int line_number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        ++line_number;
+        char* comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+
+        char shape[32];
+        int consumed = 0;
+        if (sscanf(line, "%31s%n", shape, &consumed) != 1)
+            continue;
+
+        std::vector<float> numbers;
+        const char* p = line + consumed;
+        for (;;) {
+            char* end;
+            float value = strtof(p, &end);
+            if (end == p)
+                break;
+            numbers.push_back(value);
+            p = end;
+        }
+        std::vector<Vec2> points;
+        for (size_t k = 0; k + 1 < numbers.size(); k += 2)
+            points.push_back(Vec2(numbers[k], numbers[k + 1]));
+        if (numbers.size() % 2)
+            points.clear();
+
+        if (strcmp(shape, "emitter") == 0 && numbers.size() >= 5 && numbers.size() <= 8) {
+            Emitter e;
+            e.pos = Vec2(numbers[0], numbers[1]);
+            e.velocity = Vec2(numbers[2], numbers[3]);
+            e.rate = std::max(0.0f, numbers[4]);
+            e.width = numbers.size() >= 6 ? numbers[5] : 0.0f;
+            e.spread = numbers.size() >= 7 ? numbers[6] : 0.0f;
+            e.limit = numbers.size() >= 8 ? std::max(0, (int)numbers[7]) : 0;
+            e.handles.reserve(e.limit);
+            emitters.push_back(e);
+        } else if (strcmp(shape, "killzone") == 0 && numbers.size() == 4) {
+            KillZone z;
+            z.min_x = std::min(numbers[0], numbers[2]);
+            z.min_y = std::min(numbers[1], numbers[3]);
+            z.max_x = std::max(numbers[0], numbers[2]);
+            z.max_y = std::max(numbers[1], numbers[3]);
+            kill_zones.push_back(z);
+        } else if (strcmp(shape, "chain") == 0 && numbers.size() >= 5 && numbers.size() <= 6) {
+            SceneBody body;
+            body.shape = BODY_CHAIN;
+            body.origin = Vec2(numbers[0], numbers[1]);
+            body.end = Vec2(numbers[2], numbers[3]);
+            body.cols = (int)numbers[4];
+            body.compliance = numbers.size() >= 6 ? std::max(0.0f, numbers[5]) : 0.0f;
+            ok = add_scene_body(body, path, line_number);
+        } else if (strcmp(shape, "cloth") == 0 && numbers.size() >= 5 && numbers.size() <= 6) {
+            SceneBody body;
+            body.shape = BODY_CLOTH;
+            body.origin = Vec2(numbers[0], numbers[1]);
+            body.cols = (int)numbers[2];
+            body.rows = (int)numbers[3];
+            body.size = numbers[4];
+            body.compliance = numbers.size() >= 6 ? std::max(0.0f, numbers[5]) : 0.0f;
+            ok = add_scene_body(body, path, line_number);
+        } else if (strcmp(shape, "ring") == 0 && numbers.size() >= 4 && numbers.size() <= 5) {
+            SceneBody body;
+            body.shape = BODY_RING;
+            body.origin = Vec2(numbers[0], numbers[1]);
+            body.size = numbers[2];
+            body.cols = (int)numbers[3];
+            body.compliance = numbers.size() >= 5 ? std::max(0.0f, numbers[4]) : 0.0f;
+            ok = add_scene_body(body, path, line_number);
+        } else if (strcmp(shape, "pin") == 0 && points.size() == 1) {
+            scene_pins.push_back(points[0]);
+        } else if (strcmp(shape, "segment") == 0 && points.size() == 2) {
+            add_static_collider(COLLIDER_SEGMENT, points);
+        } else if (strcmp(shape, "polygon") == 0 && points.size() >= 3) {
+            if (polygon_area(points) < 0.0f)
+                std::reverse(points.begin(), points.end());
+            if (polygon_is_degenerate(points)) {
+                SDL_Log("Scene %s:%d: polygon has a zero-length edge or no area", path, line_number);
+                ok = false;
+            } else if (!polygon_is_convex(points)) {
+                SDL_Log("Scene %s:%d: polygon is not convex", path, line_number);
+                ok = false;
+            } else {
+                add_static_collider(COLLIDER_POLYGON, points);
+            }
+        } else {
+            SDL_Log("Scene %s:%d: expected 'segment x0 y0 x1 y1', 'polygon x0 y0 x1 y1 x2 y2 ...', "
+                    "'emitter x y vx vy rate [width [spread [limit]]]', 'killzone x0 y0 x1 y1', "
+                    "'chain x0 y0 x1 y1 count [compliance]', 'cloth x y cols rows spacing [compliance]', "
+                    "'ring x y radius count [compliance]' or 'pin x y'", path, line_number);
+            ok = false;
+        }
+    }
+    fclose(file);
+    if (!ok)
+        return false;
+    if (!scene_pins.empty() && scene_bodies.empty()) {
+        SDL_Log("Scene %s: pins need a chain, cloth or ring to hold", path);
+        return false;
+    }
+
+    build_bvh();
+    SDL_Log("Scene %s: %d colliders, %d BVH nodes, %d emitters, %d kill zones, %d bodies, %d pins", path,
+            (int)static_colliders.size(), (int)bvh_nodes.size(), (int)emitters.size(), (int)kill_zones.size(),
+            (int)scene_bodies.size(), (int)scene_pins.size());
+    return true;
+}
+
+// Узкая фаза со статикой: запрос в BVH рамкой шара с запасом CONTACT_MARGIN
+void collect_static_contacts() {
+    static_contacts.clear();
+    static_group_start.clear();
+    stat_static_contacts = 0;
+    if (bvh_nodes.empty())
+        return;
+
+    const float* x = balls.x.data();
+    const float* y = balls.y.data();
+    const float* radius = balls.radius.data();
+    int n = balls.size();
+    for (int i = 0; i < n; ++i) {
+        if (balls.asleep[i])
+            continue;
+        float reach = radius[i] + CONTACT_MARGIN;
+        int before = (int)static_contacts.size();
+        query_bvh(x[i] - reach, y[i] - reach, x[i] + reach, y[i] + reach, [&](int c) {
+            Vec2 normal;
+            if (collider_distance(static_colliders[c], Vec2(x[i], y[i]), normal) < reach)
+                static_contacts.push_back(StaticContact{i, c, normal});
+        });
+        if ((int)static_contacts.size() > before) {
+            static_group_start.push_back(before);
+            balls.colliding[i] = true;
         }
     }
+    static_group_start.push_back((int)static_contacts.size());
+    stat_static_contacts = (int)static_contacts.size();
+}
+
+// Проход по контактам со статикой: шар выталкивается из геометрии целиком, у статики
+// бесконечная масса. reflect_velocity — для скоростных солверов: входящая нормальная
+// составляющая vel отражается с тем же 0.7, что у стен мира. Возвращает наибольшее проникновение
+float solve_static_contacts(bool reflect_velocity) {
+    int groups = (int)static_group_start.size() - 1;
+    if (groups <= 0)
+        return 0.0f;
+
+    std::atomic<float> pass_max(0.0f);
+    thread_pool.parallel_for(0, groups, 256, [reflect_velocity, &pass_max](int begin, int end) {
+        float max_penetration = 0.0f;
+        for (int g = begin; g < end; ++g) {
+            for (int k = static_group_start[g]; k < static_group_start[g + 1]; ++k) {
+                const StaticContact& contact = static_contacts[k];
+                int i = contact.ball;
+                Vec2 normal;
+                float dist = collider_distance(static_colliders[contact.collider], Vec2(balls.x[i], balls.y[i]), normal);
+                // у отрезка нет внутренности: центр, перешедший на другую сторону, иначе
+                // вытолкнуло бы насквозь — возвращаем его туда, откуда он пришёл
+                if (static_colliders[contact.collider].shape == COLLIDER_SEGMENT &&
+                    normal.x * contact.side.x + normal.y * contact.side.y < 0.0f) {
+                    normal = Vec2(-normal.x, -normal.y);
+                    dist = -dist;
+                }
+                float penetration = balls.radius[i] - dist;
+                if (penetration <= 0.0f)
+                    continue;
+                balls.x[i] += normal.x * penetration;
+                balls.y[i] += normal.y * penetration;
+                max_penetration = std::max(max_penetration, penetration);
+
+                float vn = balls.vel_x[i] * normal.x + balls.vel_y[i] * normal.y;
+                if (reflect_velocity && vn < 0.0f) {
+                    balls.vel_x[i] -= 1.7f * vn * normal.x;
+                    balls.vel_y[i] -= 1.7f * vn * normal.y;
+                }
+            }
+        }
+        atomic_max(pass_max, max_penetration);
+    });
+    return pass_max.load();
+}
+
+// Тела сцены. Их шары создаются первыми в init_balls, связи копятся в порядке создания
+// и раскрашиваются одним проходом в конце
+std::vector<int> body_link_a, body_link_b;
+std::vector<float> body_link_compliance;
+std::vector<Uint8> ball_pinned;
+
+int scene_body_balls() {
+    int count = 0;
+    for (const SceneBody& body : scene_bodies)
+        count += body_ball_count(body);
+    return count;
+}
+
+int add_body_ball(SceneBody& body, float x, float y, float radius) {
+    Ball b = random_ball(x, y);
+    b.vel = Vec2(0.0f, 0.0f);
+    b.radius = radius;
+    b.color = {(Uint8)(210 + rand() % 40), (Uint8)(120 + rand() % 60), 40, 255};   // тела — оранжевые
+    balls.push_back(b);
+    body.min_x = std::min(body.min_x, x - radius);
+    body.min_y = std::min(body.min_y, y - radius);
+    body.max_x = std::max(body.max_x, x + radius);
+    body.max_y = std::max(body.max_y, y + radius);
+    return balls.size() - 1;
+}
+
+void add_body_link(int a, int b, float compliance) {
+    body_link_a.push_back(a);
+    body_link_b.push_back(b);
+    body_link_compliance.push_back(compliance);
+}
+
+// Жадная раскраска, как у контактов; длина покоя — начальное расстояние. Связь между двумя
+// закреплёнными шарами ничего не решает и выбрасывается
+void build_distance_constraints() {
+    DistanceConstraints& out = distance_constraints;
+    int m = (int)body_link_a.size();
+    std::vector<uint64_t> color_mask(balls.size(), 0);
+    std::vector<int> color(m);
+    out.batch_start.assign(MAX_CONTACT_COLORS + 2, 0);
+
+    for (int k = 0; k < m; ++k) {
+        int a = body_link_a[k];
+        int b = body_link_b[k];
+        color[k] = -1;
+        if (ball_pinned[a] && ball_pinned[b])
+            continue;
+        uint64_t used = color_mask[a] | color_mask[b];
+        int c = MAX_CONTACT_COLORS;
+        if (~used) {
+            c = __builtin_ctzll(~used);
+            color_mask[a] |= 1ull << c;
+            color_mask[b] |= 1ull << c;
+        }
+        color[k] = c;
+        out.batch_start[c + 1]++;
+    }
+    for (int c = 0; c <= MAX_CONTACT_COLORS; ++c)
+        out.batch_start[c + 1] += out.batch_start[c];
+
+    int count = out.batch_start[MAX_CONTACT_COLORS + 1];
+    out.a.resize(count);
+    out.b.resize(count);
+    out.rest.resize(count);
+    out.compliance.resize(count);
+    out.wa.resize(count);
+    out.wb.resize(count);
+    out.lambda.assign(count, 0.0f);
+    std::vector<int> fill(out.batch_start.begin(), out.batch_start.end() - 1);
+    for (int k = 0; k < m; ++k) {
+        if (color[k] < 0)
+            continue;
+        int slot = fill[color[k]]++;
+        int a = body_link_a[k];
+        int b = body_link_b[k];
+        float dx = balls.x[b] - balls.x[a];
+        float dy = balls.y[b] - balls.y[a];
+        out.a[slot] = a;
+        out.b[slot] = b;
+        out.rest[slot] = sqrtf(dx * dx + dy * dy);
+        out.compliance[slot] = body_link_compliance[k];
+        out.wa[slot] = ball_pinned[a] ? 0.0f : 1.0f;
+        out.wb[slot] = ball_pinned[b] ? 0.0f : 1.0f;
+    }
+
+    stat_constraint_colors = 0;
+    for (int c = 0; c < MAX_CONTACT_COLORS; ++c)
+        if (out.batch_start[c + 1] > out.batch_start[c])
+            stat_constraint_colors = c + 1;
+    stat_constraint_conflicts = count - out.batch_start[MAX_CONTACT_COLORS];
+}
+
+// Шары тел занимают индексы [0, scene_body_balls()); вызывается из init_balls после clear
+void spawn_scene_bodies() {
+    body_link_a.clear();
+    body_link_b.clear();
+    body_link_compliance.clear();
+    pins.ball.clear();
+    pins.x.clear();
+    pins.y.clear();
+
+    for (SceneBody& body : scene_bodies) {
+        body.min_x = body.min_y = INFINITY;
+        body.max_x = body.max_y = -INFINITY;
+        float spacing = body_spacing(body);
+        float radius = std::min(0.5f * spacing - CONTACT_MARGIN, (float)(MIN_SIZE + MAX_SIZE - 1));
+        int first = balls.size();
+
+        if (body.shape == BODY_CHAIN) {
+            for (int k = 0; k < body.cols; ++k) {
+                float t = (float)k / (body.cols - 1);
+                add_body_ball(body, body.origin.x + (body.end.x - body.origin.x) * t,
+                              body.origin.y + (body.end.y - body.origin.y) * t, radius);
+                if (k > 0)
+                    add_body_link(first + k - 1, first + k, body.compliance);
+            }
+        } else if (body.shape == BODY_CLOTH) {
+            // стороны держат растяжение, диагонали — сдвиг
+            for (int row = 0; row < body.rows; ++row) {
+                for (int col = 0; col < body.cols; ++col) {
+                    int i = add_body_ball(body, body.origin.x + col * spacing, body.origin.y + row * spacing, radius);
+                    if (col > 0)
+                        add_body_link(i - 1, i, body.compliance);
+                    if (row > 0)
+                        add_body_link(i - body.cols, i, body.compliance);
+                    if (row > 0 && col > 0)
+                        add_body_link(i - body.cols - 1, i, body.compliance);
+                    if (row > 0 && col + 1 < body.cols)
+                        add_body_link(i - body.cols + 1, i, body.compliance);
+                }
+            }
+        } else {
+            // обод жёсткий; через одного и поперёк — податливые распорки, они и дают упругость
+            int n = body.cols;
+            for (int k = 0; k < n; ++k) {
+                float angle = 2.0f * (float)M_PI * k / n;
+                add_body_ball(body, body.origin.x + body.size * cosf(angle), body.origin.y + body.size * sinf(angle), radius);
+            }
+            for (int k = 0; k < n; ++k) {
+                add_body_link(first + k, first + (k + 1) % n, 0.0f);
+                add_body_link(first + k, first + (k + 2) % n, body.compliance);
+                if (k < n / 2)
+                    add_body_link(first + k, first + k + n / 2, body.compliance);
+            }
+        }
+    }
+
+    // булавка берёт ближайший шар тел; второй раз тот же шар не закрепляется
+    int body_balls = balls.size();
+    ball_pinned.assign(body_balls, 0);
+    for (const Vec2& pin : scene_pins) {
+        int best = -1;
+        float best_dist2 = INFINITY;
+        for (int i = 0; i < body_balls; ++i) {
+            float dx = balls.x[i] - pin.x;
+            float dy = balls.y[i] - pin.y;
+            if (dx * dx + dy * dy < best_dist2) {
+                best_dist2 = dx * dx + dy * dy;
+                best = i;
+            }
+        }
+        if (best < 0 || ball_pinned[best])
+            continue;
+        ball_pinned[best] = 1;
+        pins.ball.push_back(best);
+        pins.x.push_back(balls.x[best]);
+        pins.y.push_back(balls.y[best]);
+    }
+
+    build_distance_constraints();
+    ball_pinned.clear();
+}
+
+bool overlaps_scene_body(float x, float y, float radius) {
+    for (const SceneBody& body : scene_bodies)
+        if (x + radius > body.min_x && x - radius < body.max_x && y + radius > body.min_y && y - radius < body.max_y)
+            return true;
+    return false;
+}
+
+void reset_constraint_lambdas() {
+    std::fill(distance_constraints.lambda.begin(), distance_constraints.lambda.end(), 0.0f);
+}
+
+// Проекция связи XPBD с равными массами: dl = (-C - alpha * lambda) / (wa + wb + alpha),
+// где C = |d| - rest, alpha = compliance / dt^2. a сдвигается на -wa * dl вдоль d, b — на +wb * dl.
+// velocity_scale != 0 — та же поправка добавляется к vel (для солверов, которые ведут скорость сами).
+// max_error — наибольшее |C| среди жёстких связей
+void solve_distance_scalar(int begin, int end, float inv_dt2, float velocity_scale, float& max_error) {
+    DistanceConstraints& c = distance_constraints;
+    float* __restrict x = balls.x.data();
+    float* __restrict y = balls.y.data();
+    float max_err = max_error;
+
+    for (int k = begin; k < end; ++k) {
+        int a = c.a[k];
+        int b = c.b[k];
+        float dx = x[b] - x[a];
+        float dy = y[b] - y[a];
+        float dist2 = dx * dx + dy * dy;
+        if (dist2 <= 0.0001f)
+            continue;
+
+        float dist = sqrtf(dist2);
+        float error = dist - c.rest[k];
+        float alpha = c.compliance[k] * inv_dt2;
+        float dl = (-error - alpha * c.lambda[k]) / (c.wa[k] + c.wb[k] + alpha);
+        c.lambda[k] += dl;
+        if (c.compliance[k] == 0.0f)
+            max_err = std::max(max_err, fabsf(error));
+
+        float s = dl / dist;
+        float cx = dx * s;
+        float cy = dy * s;
+        x[a] -= cx * c.wa[k];
+        y[a] -= cy * c.wa[k];
+        x[b] += cx * c.wb[k];
+        y[b] += cy * c.wb[k];
+        if (velocity_scale != 0.0f) {
+            balls.vel_x[a] -= cx * c.wa[k] * velocity_scale;
+            balls.vel_y[a] -= cy * c.wa[k] * velocity_scale;
+            balls.vel_x[b] += cx * c.wb[k] * velocity_scale;
+            balls.vel_y[b] += cy * c.wb[k] * velocity_scale;
+        }
+    }
+    max_error = max_err;
+}
+
+#if defined(__SSE2__)
+// 4 связи за раз, сборка и запись по индексам — как в solve_contacts_sse
+int solve_distance_sse(int begin, int end, float inv_dt2, float& max_error) {
+    DistanceConstraints& c = distance_constraints;
+    float* x = balls.x.data();
+    float* y = balls.y.data();
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 min_dist2 = _mm_set1_ps(0.0001f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 scale_alpha = _mm_set1_ps(inv_dt2);
+    __m128 max_err = _mm_set1_ps(max_error);
+    alignas(16) float out_ax[4], out_ay[4], out_bx[4], out_by[4];
+
+    int k = begin;
+    for (; k + 4 <= end; k += 4) {
+        const int* a = c.a.data() + k;
+        const int* b = c.b.data() + k;
+
+        __m128 ax = _mm_setr_ps(x[a[0]], x[a[1]], x[a[2]], x[a[3]]);
+        __m128 ay = _mm_setr_ps(y[a[0]], y[a[1]], y[a[2]], y[a[3]]);
+        __m128 bx = _mm_setr_ps(x[b[0]], x[b[1]], x[b[2]], x[b[3]]);
+        __m128 by = _mm_setr_ps(y[b[0]], y[b[1]], y[b[2]], y[b[3]]);
+        __m128 rest = _mm_loadu_ps(c.rest.data() + k);
+        __m128 compliance = _mm_loadu_ps(c.compliance.data() + k);
+        __m128 wa = _mm_loadu_ps(c.wa.data() + k);
+        __m128 wb = _mm_loadu_ps(c.wb.data() + k);
+        __m128 lam = _mm_loadu_ps(c.lambda.data() + k);
+
+        __m128 dx = _mm_sub_ps(bx, ax);
+        __m128 dy = _mm_sub_ps(by, ay);
+        __m128 dist2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 active = _mm_cmpgt_ps(dist2, min_dist2);
+
+        __m128 dist = _mm_sqrt_ps(dist2);
+        __m128 error = _mm_sub_ps(dist, rest);
+        __m128 alpha = _mm_mul_ps(compliance, scale_alpha);
+        __m128 dl = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, error), _mm_mul_ps(alpha, lam)),
+                               _mm_add_ps(_mm_add_ps(wa, wb), alpha));
+        dl = _mm_and_ps(active, dl);
+        _mm_storeu_ps(c.lambda.data() + k, _mm_add_ps(lam, dl));
+        __m128 rigid = _mm_and_ps(active, _mm_cmpeq_ps(compliance, zero));
+        max_err = _mm_max_ps(max_err, _mm_and_ps(rigid, _mm_and_ps(abs_mask, error)));
+
+        __m128 s = _mm_and_ps(active, _mm_div_ps(dl, dist));
+        __m128 cx = _mm_mul_ps(dx, s);
+        __m128 cy = _mm_mul_ps(dy, s);
+
+        _mm_store_ps(out_ax, _mm_sub_ps(ax, _mm_mul_ps(cx, wa)));
+        _mm_store_ps(out_ay, _mm_sub_ps(ay, _mm_mul_ps(cy, wa)));
+        _mm_store_ps(out_bx, _mm_add_ps(bx, _mm_mul_ps(cx, wb)));
+        _mm_store_ps(out_by, _mm_add_ps(by, _mm_mul_ps(cy, wb)));
+
+        for (int l = 0; l < 4; ++l) {
+            x[a[l]] = out_ax[l];
+            y[a[l]] = out_ay[l];
+            x[b[l]] = out_bx[l];
+            y[b[l]] = out_by[l];
+        }
+    }
+
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, max_err);
+    max_error = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    return k;
+}
+
+// 8 связей за раз через gather
+__attribute__((target("avx2")))
+int solve_distance_avx2(int begin, int end, float inv_dt2, float& max_error) {
+    DistanceConstraints& c = distance_constraints;
+    float* x = balls.x.data();
+    float* y = balls.y.data();
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 min_dist2 = _mm256_set1_ps(0.0001f);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 scale_alpha = _mm256_set1_ps(inv_dt2);
+    __m256 max_err = _mm256_set1_ps(max_error);
+    alignas(32) float out_ax[8], out_ay[8], out_bx[8], out_by[8];
+
+    int k = begin;
+    for (; k + 8 <= end; k += 8) {
+        const int* a = c.a.data() + k;
+        const int* b = c.b.data() + k;
+        __m256i ia = _mm256_loadu_si256((const __m256i*)a);
+        __m256i ib = _mm256_loadu_si256((const __m256i*)b);
+
+        __m256 ax = _mm256_i32gather_ps(x, ia, 4);
+        __m256 ay = _mm256_i32gather_ps(y, ia, 4);
+        __m256 bx = _mm256_i32gather_ps(x, ib, 4);
+        __m256 by = _mm256_i32gather_ps(y, ib, 4);
+        __m256 rest = _mm256_loadu_ps(c.rest.data() + k);
+        __m256 compliance = _mm256_loadu_ps(c.compliance.data() + k);
+        __m256 wa = _mm256_loadu_ps(c.wa.data() + k);
+        __m256 wb = _mm256_loadu_ps(c.wb.data() + k);
+        __m256 lam = _mm256_loadu_ps(c.lambda.data() + k);
+
+        __m256 dx = _mm256_sub_ps(bx, ax);
+        __m256 dy = _mm256_sub_ps(by, ay);
+        __m256 dist2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 active = _mm256_cmp_ps(dist2, min_dist2, _CMP_GT_OQ);
+
+        __m256 dist = _mm256_sqrt_ps(dist2);
+        __m256 error = _mm256_sub_ps(dist, rest);
+        __m256 alpha = _mm256_mul_ps(compliance, scale_alpha);
+        __m256 dl = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(zero, error), _mm256_mul_ps(alpha, lam)),
+                                  _mm256_add_ps(_mm256_add_ps(wa, wb), alpha));
+        dl = _mm256_and_ps(active, dl);
+        _mm256_storeu_ps(c.lambda.data() + k, _mm256_add_ps(lam, dl));
+        __m256 rigid = _mm256_and_ps(active, _mm256_cmp_ps(compliance, zero, _CMP_EQ_OQ));
+        max_err = _mm256_max_ps(max_err, _mm256_and_ps(rigid, _mm256_and_ps(abs_mask, error)));
+
+        __m256 s = _mm256_and_ps(active, _mm256_div_ps(dl, dist));
+        __m256 cx = _mm256_mul_ps(dx, s);
+        __m256 cy = _mm256_mul_ps(dy, s);
+
+        _mm256_store_ps(out_ax, _mm256_sub_ps(ax, _mm256_mul_ps(cx, wa)));
+        _mm256_store_ps(out_ay, _mm256_sub_ps(ay, _mm256_mul_ps(cy, wa)));
+        _mm256_store_ps(out_bx, _mm256_add_ps(bx, _mm256_mul_ps(cx, wb)));
+        _mm256_store_ps(out_by, _mm256_add_ps(by, _mm256_mul_ps(cy, wb)));
+
+        for (int l = 0; l < 8; ++l) {
+            x[a[l]] = out_ax[l];
+            y[a[l]] = out_ay[l];
+            x[b[l]] = out_bx[l];
+            y[b[l]] = out_by[l];
+        }
+    }
+
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, max_err);
+    float result = lanes[0];
+    for (int l = 1; l < 8; ++l)
+        result = std::max(result, lanes[l]);
+    max_error = result;
+    return k;
+}
+#endif
+
+float solve_distance_batch(int begin, int end, float inv_dt2, float velocity_scale) {
+    float max_error = 0.0f;
+    int done = begin;
+#if defined(__SSE2__)
+    if (PBD_KERNEL == PBD_KERNEL_SIMD && velocity_scale == 0.0f)
+        done = cpu_has_avx2() ? solve_distance_avx2(begin, end, inv_dt2, max_error)
+                              : solve_distance_sse(begin, end, inv_dt2, max_error);
+#endif
+    solve_distance_scalar(done, end, inv_dt2, velocity_scale, max_error);
+    return max_error;
+}
+
+// Булавки не пересекаются по шарам; возвращают наибольший сдвиг
+float solve_pins(float velocity_scale) {
+    float max_error = 0.0f;
+    for (size_t k = 0; k < pins.ball.size(); ++k) {
+        int i = pins.ball[k];
+        float dx = pins.x[k] - balls.x[i];
+        float dy = pins.y[k] - balls.y[i];
+        max_error = std::max(max_error, sqrtf(dx * dx + dy * dy));
+        balls.x[i] = pins.x[k];
+        balls.y[i] = pins.y[k];
+        if (velocity_scale != 0.0f) {
+            balls.vel_x[i] += dx * velocity_scale;
+            balls.vel_y[i] += dy * velocity_scale;
+        }
+    }
+    return max_error;
+}
+
+// Один проход по всем связям: батчи по цветам (каждый можно делить между потоками),
+// конфликтный — по одной, потом булавки. Возвращает наибольшее отклонение жёстких связей
+float solve_ball_constraints(bool parallel, float velocity_scale) {
+    DistanceConstraints& c = distance_constraints;
+    if (c.a.empty() && pins.ball.empty())
+        return 0.0f;
+
+    PROFILE_SCOPE("constraints");
+    float step_rate = (float)(PHYSICS_HZ * SUBSTEPS);
+    float inv_dt2 = step_rate * step_rate;
+    std::atomic<float> pass_max(0.0f);
+    std::function<void(int, int)> job = [inv_dt2, velocity_scale, &pass_max](int begin, int end) {
+        atomic_max(pass_max, solve_distance_batch(begin, end, inv_dt2, velocity_scale));
+    };
+    for (int color = 0; color < MAX_CONTACT_COLORS; ++color) {
+        int begin = c.batch_start[color];
+        int end = c.batch_start[color + 1];
+        if (begin >= end)
+            continue;
+        if (parallel)
+            thread_pool.parallel_for(begin, end, 256, job);
+        else
+            job(begin, end);
+    }
+
+    float conflict_max = 0.0f;
+    solve_distance_scalar(c.batch_start[MAX_CONTACT_COLORS], c.batch_start[MAX_CONTACT_COLORS + 1], inv_dt2,
+                          velocity_scale, conflict_max);
+    float pin_max = solve_pins(velocity_scale);
+    stat_constraint_error = std::max(std::max(pass_max.load(), conflict_max), pin_max);
+    return stat_constraint_error;
+}
+
+// Сон: шар, который SLEEP_TIME секунд не отходил от своей опорной точки дальше
+// SLEEP_DISTANCE, считается неподвижным. Засыпают и просыпаются острова целиком —
+// связные компоненты графа контактов, — иначе верхний шар уснёт на проснувшемся нижнем
+std::vector<int> island_parent;
+std::vector<float> island_min_still;
+std::vector<Uint8> island_wake;    // флаг "разбудить остров" по id острова
+
+int find_island(int i) {
+    while (island_parent[i] != i) {
+        island_parent[i] = island_parent[island_parent[i]];
+        i = island_parent[i];
+    }
+    return i;
+}
+
+void union_islands(int a, int b) {
+    a = find_island(a);
+    b = find_island(b);
+    if (a != b)
+        island_parent[std::max(a, b)] = std::min(a, b);
+}
+
+void mark_island_awake(int ball) {
+    island_wake.resize(balls.size(), 0);
+    island_wake[balls.sleep_island[ball]] = 1;
+}
+
+// Будит все шары помеченных островов; опорная точка сбрасывается, чтобы шар,
+// из-под которого выбили опору, не уснул снова в воздухе
+void wake_marked_islands() {
+    if (island_wake.empty())
+        return;
+
+    for (int i = 0; i < balls.size(); ++i) {
+        if (balls.asleep[i] && island_wake[balls.sleep_island[i]]) {
+            balls.asleep[i] = 0;
+            balls.still_time[i] = 0.0f;
+            balls.anchor_x[i] = balls.x[i];
+            balls.anchor_y[i] = balls.y[i];
+        }
+    }
+    island_wake.clear();
+}
+
+void wake_all_balls() {
+    for (int i = 0; i < balls.size(); ++i) {
+        balls.asleep[i] = 0;
+        balls.still_time[i] = 0.0f;
+    }
+}
+
+// Раз в тик: по контактам последнего подшага строит острова из бодрствующих шаров,
+// будит спящие острова, которых коснулся бодрствующий шар, и усыпляет неподвижные острова
+void update_sleep(float tick) {
+    int n = balls.size();
+    float* x = balls.x.data();
+    float* y = balls.y.data();
+
+    for (int i = 0; i < n; ++i) {
+        if (balls.asleep[i])
+            continue;
+        float dx = x[i] - balls.anchor_x[i];
+        float dy = y[i] - balls.anchor_y[i];
+        if (dx * dx + dy * dy > SLEEP_DISTANCE * SLEEP_DISTANCE) {
+            balls.anchor_x[i] = x[i];
+            balls.anchor_y[i] = y[i];
+            balls.still_time[i] = 0.0f;
+        } else {
+            balls.still_time[i] += tick;
+        }
+    }
+
+    island_parent.resize(n);
+    for (int i = 0; i < n; ++i)
+        island_parent[i] = i;
+
+    // контакты спящего шара со спящим в список не попадают, см. test_contact
+    for (const BallPair& pair : contact_pairs) {
+        bool sleep_a = balls.asleep[pair.a];
+        bool sleep_b = balls.asleep[pair.b];
+        if (sleep_a)
+            mark_island_awake(pair.a);
+        else if (sleep_b)
+            mark_island_awake(pair.b);
+        else
+            union_islands(pair.a, pair.b);
+    }
+    // тело засыпает и просыпается целиком
+    const DistanceConstraints& links = distance_constraints;
+    for (size_t k = 0; k < links.a.size(); ++k) {
+        bool sleep_a = balls.asleep[links.a[k]];
+        bool sleep_b = balls.asleep[links.b[k]];
+        if (sleep_a && !sleep_b)
+            mark_island_awake(links.a[k]);
+        else if (sleep_b && !sleep_a)
+            mark_island_awake(links.b[k]);
+        else if (!sleep_a)
+            union_islands(links.a[k], links.b[k]);
+    }
+    wake_marked_islands();
+
+    island_min_still.assign(n, SLEEP_TIME);
+    for (int i = 0; i < n; ++i) {
+        if (balls.asleep[i])
+            continue;
+        int root = find_island(i);
+        island_min_still[root] = std::min(island_min_still[root], balls.still_time[i]);
+    }
+
+    int sleeping = 0;
+    int islands = 0;
+    for (int i = 0; i < n; ++i) {
+        if (!balls.asleep[i]) {
+            int root = find_island(i);
+            if (island_min_still[root] < SLEEP_TIME)
+                continue;
+            // засыпая, шар теряет остаточную скорость
+            balls.asleep[i] = 1;
+            balls.sleep_island[i] = root;
+            balls.prev_x[i] = x[i];
+            balls.prev_y[i] = y[i];
+            balls.vel_x[i] = balls.vel_y[i] = 0.0f;
+        }
+        ++sleeping;
+        if (balls.sleep_island[i] == i)
+            ++islands;
+    }
+    stat_sleeping = sleeping;
+    stat_islands = islands;
+}
+
+// Перестановка шаров по кривой Мортона (Z-order): соседи в пространстве становятся
+// соседями в массивах, и солвер с broad phase реже промахиваются мимо кэша.
+// Все, кто хранит индексы шаров между тиками, переводятся через reorder_remap
+std::vector<uint32_t> morton_keys, morton_keys_tmp;
+std::vector<int> morton_order, morton_order_tmp;
+std::vector<int> reorder_remap;   // старый индекс -> новый (-1 — удалён), после последней перестановки
+std::vector<float> reorder_lambda;
+int ticks_since_reorder = 0;
+
+uint32_t spread_bits(uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// LSD radix sort по 8 бит: ключи Мортона вместе с исходными индексами
+void radix_sort_morton() {
+    int n = (int)morton_keys.size();
+    morton_keys_tmp.resize(n);
+    morton_order_tmp.resize(n);
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        int count[257] = {0};
+        for (int i = 0; i < n; ++i)
+            count[((morton_keys[i] >> shift) & 0xff) + 1]++;
+        for (int d = 0; d < 256; ++d)
+            count[d + 1] += count[d];
+        for (int i = 0; i < n; ++i) {
+            int slot = count[(morton_keys[i] >> shift) & 0xff]++;
+            morton_keys_tmp[slot] = morton_keys[i];
+            morton_order_tmp[slot] = morton_order[i];
+        }
+        morton_keys.swap(morton_keys_tmp);
+        morton_order.swap(morton_order_tmp);
+    }
+}
+
+// Удалённые шары (reorder_remap == -1) уносят свои контакты из кэша
+void remap_contact_cache() {
+    int m = (int)contact_cache.keys.size();
+    contact_keys.resize(m);
+    contact_order.resize(m);
+    reorder_lambda.resize(m);
+    int kept = 0;
+    for (int k = 0; k < m; ++k) {
+        int a = reorder_remap[(int)(contact_cache.keys[k] >> 32)];
+        int b = reorder_remap[(int)(contact_cache.keys[k] & 0xffffffffu)];
+        if (a < 0 || b < 0)
+            continue;
+        contact_keys[kept] = contact_key(a, b);
+        reorder_lambda[kept] = contact_cache.lambda[k];
+        contact_order[kept] = kept;
+        ++kept;
+    }
+    contact_order.resize(kept);
+    std::sort(contact_order.begin(), contact_order.end(), [](int i, int j) { return contact_keys[i] < contact_keys[j]; });
+
+    contact_cache.keys.resize(kept);
+    contact_cache.lambda.resize(kept);
+    for (int k = 0; k < kept; ++k) {
+        contact_cache.keys[k] = contact_keys[contact_order[k]];
+        contact_cache.lambda[k] = reorder_lambda[contact_order[k]];
+    }
+}
+
+// После перестановки шаров (reorder_remap): индексы переводятся, связи и булавки удалённых
+// шаров выпадают. Раскраска остаётся верной — в батче по-прежнему нет общих шаров
+void remap_ball_constraints() {
+    DistanceConstraints& c = distance_constraints;
+    if (!c.batch_start.empty()) {
+        int write = 0;
+        int begin = 0;
+        for (int color = 0; color <= MAX_CONTACT_COLORS; ++color) {
+            int end = c.batch_start[color + 1];
+            c.batch_start[color] = write;
+            for (int k = begin; k < end; ++k) {
+                int a = reorder_remap[c.a[k]];
+                int b = reorder_remap[c.b[k]];
+                if (a < 0 || b < 0)
+                    continue;
+                c.a[write] = a;
+                c.b[write] = b;
+                c.rest[write] = c.rest[k];
+                c.compliance[write] = c.compliance[k];
+                c.wa[write] = c.wa[k];
+                c.wb[write] = c.wb[k];
+                c.lambda[write] = c.lambda[k];
+                ++write;
+            }
+            begin = end;
+        }
+        c.batch_start[MAX_CONTACT_COLORS + 1] = write;
+        c.a.resize(write);
+        c.b.resize(write);
+        c.rest.resize(write);
+        c.compliance.resize(write);
+        c.wa.resize(write);
+        c.wb.resize(write);
+        c.lambda.resize(write);
+    }
+
+    int kept = 0;
+    for (size_t k = 0; k < pins.ball.size(); ++k) {
+        int i = reorder_remap[pins.ball[k]];
+        if (i < 0)
+            continue;
+        pins.ball[kept] = i;
+        pins.x[kept] = pins.x[k];
+        pins.y[kept] = pins.y[k];
+        ++kept;
+    }
+    pins.ball.resize(kept);
+    pins.x.resize(kept);
+    pins.y.resize(kept);
+}
+
+void reorder_balls() {
+    int n = balls.size();
+    if (n == 0)
+        return;
+
+    PROFILE_SCOPE("reorder");
+
+    float min_x = balls.x[0], max_x = min_x;
+    float min_y = balls.y[0], max_y = min_y;
+    for (int i = 0; i < n; ++i) {
+        min_x = std::min(min_x, balls.x[i]);
+        max_x = std::max(max_x, balls.x[i]);
+        min_y = std::min(min_y, balls.y[i]);
+        max_y = std::max(max_y, balls.y[i]);
+    }
+
+    // ячейка порядка диаметра шара; если мир больше 65536 ячеек — укрупняем
+    float cell = (float)(MIN_SIZE + MAX_SIZE);
+    while (std::max(max_x - min_x, max_y - min_y) / cell >= 65535.0f)
+        cell *= 2.0f;
+    float inv_cell = 1.0f / cell;
+
+    morton_keys.resize(n);
+    morton_order.resize(n);
+    for (int i = 0; i < n; ++i) {
+        uint32_t cx = (uint32_t)((balls.x[i] - min_x) * inv_cell);
+        uint32_t cy = (uint32_t)((balls.y[i] - min_y) * inv_cell);
+        morton_keys[i] = spread_bits(cx) | (spread_bits(cy) << 1);
+        morton_order[i] = i;
+    }
+    radix_sort_morton();
+
+    reorder_remap.resize(n);
+    for (int k = 0; k < n; ++k)
+        reorder_remap[morton_order[k]] = k;
+
+    balls.permute(morton_order);
+
+    // индексы, которые живут дольше одного подшага
+    for (int i = 0; i < n; ++i)
+        if (balls.sleep_island[i] >= 0)
+            balls.sleep_island[i] = reorder_remap[balls.sleep_island[i]];
+    for (int& ball : sweep_order)
+        ball = reorder_remap[ball];
+    // корзины сетки нужны силовым полям до следующей перестройки
+    if ((int)grid_cell_balls.size() == n)
+        for (int& ball : grid_cell_balls)
+            ball = reorder_remap[ball];
+    remap_contact_cache();
+    remap_ball_constraints();
+    remap_recording();
+}
+
+// Вызывается в начале тика: раз в REORDER_INTERVAL тиков переставляет шары
+void reorder_balls_if_due() {
+    if (REORDER_INTERVAL <= 0)
+        return;
+    if (++ticks_since_reorder < REORDER_INTERVAL)
+        return;
+    ticks_since_reorder = 0;
+    reorder_balls();
+}
+
+// Силовые поля: взрыв (разовый радиальный пинок), притяжение/отталкивание и ветер.
+// Всё, что накопилось за кадр, применяется в начале тика одним проходом: по ячейкам
+// сетки broad phase, которые задевают поля, — остальные шары не трогаем вовсе
+enum ForceFieldType {
+    FIELD_IMPULSE,    // пинок от центра, strength — смещение за тик на краю центра
+    FIELD_ATTRACTOR,  // ускорение к центру (px/s^2), отрицательное — отталкивание
+    FIELD_WIND,       // постоянное ускорение вдоль direction внутри круга
+};
+
+struct ForceField {
+    int type;
+    Vec2 center;
+    float radius;
+    float strength;
+    Vec2 direction;        // только для ветра, нормированный
+    float duration = 0.0f; // сколько ещё секунд действует; разовые поля живут один тик
+};
+
+std::vector<ForceField> force_fields;
+std::vector<uint64_t> field_cell_mask;  // какие из (до 64) полей задевают ячейку
+std::vector<int> field_cells;           // задетые ячейки, чтобы сбросить маски
+
+void add_force_field(const ForceField& field) {
+    force_fields.push_back(field);
+}
+
+void add_explosion(Vec2 center, float radius, float strength) {
+    ForceField field;
+    field.type = FIELD_IMPULSE;
+    field.center = center;
+    field.radius = radius;
+    field.strength = strength;
+    add_force_field(field);
+}
+
+void add_attractor(Vec2 center, float radius, float strength, float duration) {
+    ForceField field;
+    field.type = FIELD_ATTRACTOR;
+    field.center = center;
+    field.radius = radius;
+    field.strength = strength;
+    field.duration = duration;
+    add_force_field(field);
+}
+
+void add_wind(Vec2 center, float radius, Vec2 direction, float strength, float duration) {
+    ForceField field;
+    field.type = FIELD_WIND;
+    field.center = center;
+    field.radius = radius;
+    field.strength = strength;
+    field.direction = direction.normalized();
+    field.duration = duration;
+    add_force_field(field);
+}
+
+// Применяет к шару i поля из маски: бит f — поле first + f. Всё работает через prev_pos, как и раньше во взрыве:
+// Verlet превратит сдвиг prev_pos в скорость на следующем подшаге
+void apply_fields_to_ball(int i, int first, uint64_t mask, float tick) {
+    Vec2 pos = balls.pos(i);
+    // ускорение a за тик меняет скорость на a * tick, на масштабе подшага это a * tick * dt
+    float accel_scale = tick * (tick / SUBSTEPS);
+    float substep_rate = SUBSTEPS / tick;
+    bool touched = false;
+
+    while (mask) {
+        const ForceField& field = force_fields[first + __builtin_ctzll(mask)];
+        mask &= mask - 1;
+
+        Vec2 dir = pos - field.center;
+        float dist2 = dir.length_squared();
+        if (dist2 >= field.radius * field.radius || dist2 <= 1e-4f)
+            continue;
+
+        float dist = sqrtf(dist2);
+        Vec2 shift;
+        if (field.type == FIELD_IMPULSE) {
+            // сила задана как смещение за тик, а prev_pos работает на масштабе подшага
+            float force = field.strength * (1.0f - dist / field.radius) / SUBSTEPS;
+            shift = dir / dist * force;
+        } else if (field.type == FIELD_ATTRACTOR) {
+            float force = field.strength * (1.0f - dist / field.radius) * accel_scale;
+            shift = dir / dist * -force;
+        } else {
+            shift = field.direction * (field.strength * accel_scale);
+        }
+
+        balls.prev_x[i] -= shift.x;
+        balls.prev_y[i] -= shift.y;
+        // тот же толчок для интегратора по скорости: смещение за подшаг -> px/s
+        balls.vel_x[i] += shift.x * substep_rate;
+        balls.vel_y[i] += shift.y * substep_rate;
+        touched = true;
+    }
+
+    if (touched && balls.asleep[i])
+        mark_island_awake(i);
+}
+
+// Шары, которые стоит проверить для полей из group (до 64 штук начиная с first).
+// Индекс broad phase построен на прошлом подшаге, шары с тех пор сдвинулись
+// не больше чем на max_displacement() — это покрывает запас в ячейку или в само смещение
+void apply_field_group(int first, int count, float tick) {
+    int n = balls.size();
+    int visited = 0;
+
+    if (grid_cols > 0 && (int)grid_ball_cell.size() == n) {
+        field_cell_mask.resize(grid_cols * grid_rows, 0);
+        field_cells.clear();
+
+        for (int f = 0; f < count; ++f) {
+            const ForceField& field = force_fields[first + f];
+            float reach = field.radius + std::max(grid_cell_size, max_displacement());
+            int x0 = std::max(0, (int)((field.center.x - reach - grid_min_x) / grid_cell_size));
+            int y0 = std::max(0, (int)((field.center.y - reach - grid_min_y) / grid_cell_size));
+            int x1 = std::min(grid_cols - 1, (int)((field.center.x + reach - grid_min_x) / grid_cell_size));
+            int y1 = std::min(grid_rows - 1, (int)((field.center.y + reach - grid_min_y) / grid_cell_size));
+            for (int cy = y0; cy <= y1; ++cy) {
+                for (int cx = x0; cx <= x1; ++cx) {
+                    int cell = cy * grid_cols + cx;
+                    if (!field_cell_mask[cell])
+                        field_cells.push_back(cell);
+                    field_cell_mask[cell] |= 1ull << f;
+                }
+            }
+        }
+
+        // каждый шар лежит ровно в одной ячейке — все поля для него за один заход
+        for (int cell : field_cells) {
+            uint64_t mask = field_cell_mask[cell];
+            for (int k = grid_cell_start[cell]; k < grid_cell_start[cell + 1]; ++k)
+                apply_fields_to_ball(grid_cell_balls[k], first, mask, tick);
+            visited += grid_cell_start[cell + 1] - grid_cell_start[cell];
+            field_cell_mask[cell] = 0;
+        }
+    } else if ((int)sweep_order.size() == n) {
+        // sweep: шары отсортированы по левому краю, полосу по X ищем бинарным поиском
+        float pad = 2.0f * (MIN_SIZE + MAX_SIZE) + max_displacement();
+        for (int f = 0; f < count; ++f) {
+            const ForceField& field = force_fields[first + f];
+            auto begin = std::lower_bound(sweep_min_x.begin(), sweep_min_x.end(), field.center.x - field.radius - pad);
+            auto end = std::upper_bound(begin, sweep_min_x.end(), field.center.x + field.radius + max_displacement());
+            for (auto it = begin; it != end; ++it)
+                apply_fields_to_ball(sweep_order[it - sweep_min_x.begin()], first, 1ull << f, tick);
+            visited += (int)(end - begin);
+        }
+    } else {
+        // индекса ещё нет (первый тик) — полный проход
+        uint64_t mask = count == 64 ? ~0ull : (1ull << count) - 1;
+        for (int i = 0; i < n; ++i)
+            apply_fields_to_ball(i, first, mask, tick);
+        visited = n;
+    }
+
+    stat_field_balls += visited;
+}
+
+// Вызывается в начале тика: применяет все поля и выбрасывает истёкшие
+void apply_force_fields(float tick) {
+    stat_field_balls = 0;
+    if (force_fields.empty())
+        return;
+
+    PROFILE_PHASE(PHASE_FIELDS);
+    int count = (int)force_fields.size();
+    for (int first = 0; first < count; first += 64)
+        apply_field_group(first, std::min(64, count - first), tick);
+    wake_marked_islands();
+
+    int alive = 0;
+    for (int f = 0; f < count; ++f) {
+        ForceField& field = force_fields[f];
+        field.duration -= tick;
+        if (field.type != FIELD_IMPULSE && field.duration > 0.5f * tick)  // полтика — запас на ошибку округления
+            force_fields[alive++] = field;
+    }
+    force_fields.resize(alive);
+}
+
+void explode_nearby_balls_velocity_based(Vec2 center, float radius, float strength, BallStorage& balls) {
+    for (int i = 0; i < balls.size(); ++i) {
+        Vec2 pos(balls.x[i], balls.y[i]);
+        Vec2 dir = pos - center;
+
+        float dist2 = dir.length_squared();
+        if (dist2 < radius * radius && dist2 > 1e-4f) {
+            float dist = sqrtf(dist2);
+            Vec2 norm_dir = dir / dist;
+            float force = strength * (1.0f - dist / radius);
+
+            balls.vel_x[i] += norm_dir.x * force;
+            balls.vel_y[i] += norm_dir.y * force;
+        }
+    }
+}
+
+// Взрыв ставится в очередь и сработает в начале следующего тика вместе с остальными полями
+void explode_nearby_balls(Vec2 center, float radius, float strength) {
+    add_explosion(center, radius, strength);
+}
+
+// Рождение и удаление шаров на ходу. Всё делается в начале тика, когда индексы шаров
+// ещё никто не держит: зоны удаления и kill_ball помечают шары, выжившие одним проходом
+// сдвигаются к началу массивов с сохранением порядка, эмиттеры дописывают новые в конец.
+// Память под ball_capacity() шаров берётся в init_balls, так что поток рождений
+// и удалений не аллоцирует ни в массивах шаров, ни в пуле слотов
+std::vector<BallHandle> pending_kills;  // kill_ball() до следующего тика
+std::vector<Uint8> ball_dying;
+std::vector<int> compact_order;
+std::vector<int> spawned_balls;
+
+int ball_capacity() {
+    int count = BALLS_COUNT + scene_body_balls();
+    if (BALL_CAPACITY > 0)
+        return std::max(BALL_CAPACITY, count);
+    return emitters.empty() ? count : std::max(2 * count, 65536);
+}
+
+// Удаление по ссылке; устаревшая ссылка (шар уже удалён, слот занят другим) пропускается
+void kill_ball(BallHandle handle) {
+    pending_kills.push_back(handle);
+}
+
+// Выжившие сдвигаются к началу, порядок сохраняется; reorder_remap переводит старые индексы
+void compact_balls() {
+    int n = balls.size();
+
+    // спящий шар мог держать остров: его соседей будим, иначе они повиснут в воздухе
+    for (int i = 0; i < n; ++i)
+        if (ball_dying[i] && balls.asleep[i])
+            mark_island_awake(i);
+    wake_marked_islands();
+
+    compact_order.clear();
+    reorder_remap.assign(n, -1);
+    for (int i = 0; i < n; ++i) {
+        if (ball_dying[i]) {
+            balls.free_slot(i);
+            continue;
+        }
+        reorder_remap[i] = (int)compact_order.size();
+        compact_order.push_back(i);
+    }
+    balls.permute(compact_order);
+
+    // у спящих острова целые, так что и их id остались живыми шарами
+    for (int i = 0; i < balls.size(); ++i)
+        if (balls.sleep_island[i] >= 0)
+            balls.sleep_island[i] = reorder_remap[balls.sleep_island[i]];
+    int kept = 0;
+    for (int ball : sweep_order)
+        if (reorder_remap[ball] >= 0)
+            sweep_order[kept++] = reorder_remap[ball];
+    sweep_order.resize(kept);
+    remap_contact_cache();
+    remap_ball_constraints();
+    remap_recording();
+}
+
+// Шары у сопла. Сетка и sweep после сжатия указывают на старые индексы, поэтому
+// собираем их одним проходом, как зоны удаления
+std::vector<int> nozzle_balls;
+
+bool overlaps_nozzle_balls(float x, float y, float radius) {
+    for (int j : nozzle_balls) {
+        float dx = balls.x[j] - x, dy = balls.y[j] - y;
+        float r = balls.radius[j] + radius;
+        if (dx * dx + dy * dy < r * r)
+            return true;
+    }
+    return false;
+}
+
+// Эмиттер выпускает шары рядами поперёк направления: очередной ряд — когда предыдущий
+// отошёл на диаметр шара, так что новые не рождаются друг в друге. Поэтому поток
+// не быстрее width / spacing шаров на ряд и speed / spacing рядов в секунду.
+// Место, занятое шаром (сопло завалено кучей), пропускается, а шар ждёт следующего ряда
+void emit_balls(float tick) {
+    float step_dt = 1.0f / (PHYSICS_HZ * SUBSTEPS);
+    float spacing = 2.0f * (MIN_SIZE + MAX_SIZE);
+
+    for (Emitter& e : emitters) {
+        float speed = sqrtf(e.velocity.x * e.velocity.x + e.velocity.y * e.velocity.y);
+        if (speed <= 0.0f)
+            continue;
+        Vec2 dir(e.velocity.x / speed, e.velocity.y / speed);
+        Vec2 side(-dir.y, dir.x);
+        int cols = std::max(1, (int)(e.width / spacing));
+
+        // не успевающие выйти шары копятся не больше чем на два ряда
+        e.pending = std::min(e.pending + e.rate * tick, 2.0f * cols);
+        e.travel += speed * tick;
+        if (e.travel < spacing || e.pending < 1.0f)
+            continue;
+
+        // ряды лягут между соплом и travel впереди него, шириной cols * spacing
+        float half = 0.5f * cols * spacing;
+        Vec2 far(e.pos.x + dir.x * e.travel, e.pos.y + dir.y * e.travel);
+        float min_x = std::min(e.pos.x, far.x) - fabsf(side.x) * half - spacing;
+        float max_x = std::max(e.pos.x, far.x) + fabsf(side.x) * half + spacing;
+        float min_y = std::min(e.pos.y, far.y) - fabsf(side.y) * half - spacing;
+        float max_y = std::max(e.pos.y, far.y) + fabsf(side.y) * half + spacing;
+        nozzle_balls.clear();
+        for (int i = 0; i < balls.size(); ++i)
+            if (balls.x[i] >= min_x && balls.x[i] <= max_x && balls.y[i] >= min_y && balls.y[i] <= max_y)
+                nozzle_balls.push_back(i);
+
+        while (e.travel >= spacing && e.pending >= 1.0f) {
+            e.travel -= spacing;
+            int count = std::min(cols, (int)e.pending);
+            e.pending -= count;
+
+            for (int k = 0; k < count; ++k) {
+                if (balls.size() >= balls.capacity())
+                    break;
+                // ряд уже прошёл travel от сопла
+                float across = ((k + 0.5f) / count - 0.5f) * (count * spacing);
+                float x = e.pos.x + side.x * across + dir.x * e.travel;
+                float y = e.pos.y + side.y * across + dir.y * e.travel;
+                if (overlaps_static_geometry(x, y, spacing * 0.5f))
+                    continue;
+
+                Ball b = random_ball(x, y);
+                if (overlaps_nozzle_balls(x, y, b.radius)) {
+                    e.pending = std::min(e.pending + 1.0f, 2.0f * cols);
+                    continue;
+                }
+                float angle = e.spread * ((rand() % 2001) / 1000.0f - 1.0f);
+                float c = cosf(angle), s = sinf(angle);
+                b.vel = Vec2(e.velocity.x * c - e.velocity.y * s, e.velocity.x * s + e.velocity.y * c);
+                b.prev_pos = Vec2(x - b.vel.x * step_dt, y - b.vel.y * step_dt);
+                balls.push_back(b);
+                spawned_balls.push_back(balls.size() - 1);
+                nozzle_balls.push_back(balls.size() - 1);
+
+                if (e.limit > 0) {
+                    BallHandle handle = balls.handle(balls.size() - 1);
+                    if ((int)e.handles.size() < e.limit) {
+                        e.handles.push_back(handle);
+                    } else {
+                        kill_ball(e.handles[e.next]);
+                        e.handles[e.next] = handle;
+                        e.next = (e.next + 1) % e.limit;
+                    }
+                }
+            }
+        }
+        // пока стоим без шаров, сопло не копит путь
+        e.travel = std::min(e.travel, spacing);
+    }
+}
+
+// Новые шары вливаются в порядок sweep and prune слиянием с конца: досортировка
+// вставками протащила бы каждый из них через весь массив
+void merge_spawned_into_sweep() {
+    int n = balls.size();
+    int old_count = (int)sweep_order.size();
+    int added = (int)spawned_balls.size();
+    if (old_count + added != n) {
+        sweep_order.clear();  // построится заново на следующем подшаге
+        return;
+    }
+
+    auto key = [](int i) { return balls.x[i] - balls.radius[i]; };
+    std::sort(spawned_balls.begin(), spawned_balls.end(), [&key](int i, int j) { return key(i) < key(j); });
+    sweep_order.resize(n);
+    int a = old_count - 1, b = added - 1;
+    for (int write = n - 1; b >= 0; --write) {
+        if (a >= 0 && key(sweep_order[a]) > key(spawned_balls[b]))
+            sweep_order[write] = sweep_order[a--];
+        else
+            sweep_order[write] = spawned_balls[b--];
+    }
+}
+
+void update_ball_lifecycle(float tick) {
+    stat_spawned = stat_killed = 0;
+    if (emitters.empty() && kill_zones.empty() && pending_kills.empty())
+        return;
+
+    PROFILE_SCOPE("lifecycle");
+    int n = balls.size();
+    ball_dying.assign(n, 0);
+    int dying = 0;
+    for (int i = 0; i < n; ++i) {
+        for (const KillZone& z : kill_zones) {
+            if (balls.x[i] >= z.min_x && balls.x[i] <= z.max_x && balls.y[i] >= z.min_y && balls.y[i] <= z.max_y) {
+                ball_dying[i] = 1;
+                ++dying;
+                break;
+            }
+        }
+    }
+    for (BallHandle handle : pending_kills) {
+        int i = balls.index(handle);
+        if (i >= 0 && !ball_dying[i]) {
+            ball_dying[i] = 1;
+            ++dying;
+        }
+    }
+    pending_kills.clear();
+
+    if (dying > 0)
+        compact_balls();
+
+    spawned_balls.clear();
+    emit_balls(tick);
+
+    stat_killed = dying;
+    stat_spawned = (int)spawned_balls.size();
+    total_killed += stat_killed;
+    total_spawned += stat_spawned;
+    if (dying == 0 && spawned_balls.empty())
+        return;
+
+    merge_spawned_into_sweep();
+    // корзины сетки указывают на старые индексы — силовые поля до перестройки идут мимо сетки
+    grid_cols = grid_rows = 0;
+}
+
+// Запись прогона в файл и воспроизведение без симуляции.
+// Формат: заголовок (число шаров, радиусы, цвета) один раз, дальше кадры —
+// позиции в фиксированной точке 1/RECORD_SCALE px. Каждый RECORD_KEYFRAME_INTERVAL-й
+// кадр ключевой (абсолютные int32), остальные — разности с прошлым кадром в zigzag varint.
+// Каждый кадр помнит свой тик: выброшенные кадры оставляют дыру, и replay держит на ней
+// прошлый кадр, а не ускоряет время. В конце — таблица смещений всех кадров и футер,
+// по ним replay прыгает на любой кадр
+const uint32_t RECORD_MAGIC = 0x52443250;        // "P2DR"
+const uint32_t RECORD_INDEX_MAGIC = 0x49443250;  // "P2DI"
+const uint32_t RECORD_VERSION = 2;
+const float RECORD_SCALE = 16.0f;
+const int RECORD_KEYFRAME_INTERVAL = 60;
+const int RECORD_MAX_PENDING = 64;               // кадров в очереди писателя, сверх — выбрасываем
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ball_count;
+    uint32_t physics_hz;
+    int32_t world_width;
+    int32_t world_height;
+    float scale;
+    uint32_t keyframe_interval;
+    // дальше float radius[ball_count], SDL_Color color[ball_count]
+};
+
+struct RecordFrameHeader {
+    uint32_t keyframe;  // 1 — абсолютные позиции, 0 — разности
+    uint32_t size;      // байт данных после заголовка кадра
+    uint32_t tick;      // тик от начала записи, строго растёт
+};
+
+struct RecordFooter {
+    uint64_t index_offset;  // uint64_t offset[frame_count]
+    uint32_t frame_count;
+    uint32_t magic;
+};
+
+int32_t quantize_position(float v) {
+    return (int32_t)lrintf(v * RECORD_SCALE);
+}
+
+void put_varint(std::vector<uint8_t>& out, int32_t value) {
+    uint32_t v = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);  // zigzag
+    while (v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+// Не читает дальше end: у битого кадра недочитанное значение просто обрывается
+const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, int32_t& value) {
+    uint32_t v = 0;
+    int shift = 0;
+    uint8_t byte = 0;
+    do {
+        if (p == end)
+            break;
+        byte = *p++;
+        if (shift < 32)
+            v |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    value = (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+    return p;
+}
+
+// update() только квантует позиции и кладёт их в очередь; кодирование и fwrite —
+// в отдельном потоке. Если писатель не успевает, кадр выбрасывается, а не ждёт
+struct Recorder {
+    FILE* file = NULL;
+    int ball_count = 0;
+    std::vector<int> order;  // k-й записанный шар -> его текущий индекс, переставляется вместе с шарами
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::vector<int32_t>> pending;  // очередь кадров
+    std::vector<uint32_t> pending_ticks;        // тик каждого кадра в очереди
+    std::vector<std::vector<int32_t>> spare;    // отработанные буферы для повторного использования
+    bool stopping = false;
+    int frames_dropped = 0;
+    uint32_t tick = 0;  // тиков с начала записи, включая выброшенные
+
+    // состояние писателя
+    std::vector<int32_t> previous;
+    std::vector<uint8_t> encoded;
+    std::vector<uint64_t> frame_offsets;
+    uint64_t file_offset = 0;  // ftell на Windows 32-битный, считаем сами
+
+    bool active() const { return file != NULL; }
+
+    bool start(const char* path) {
+        file = fopen(path, "wb");
+        if (!file) {
+            SDL_Log("Cannot open %s for recording", path);
+            return false;
+        }
+
+        ball_count = balls.size();
+        RecordHeader header;
+        header.magic = RECORD_MAGIC;
+        header.version = RECORD_VERSION;
+        header.ball_count = ball_count;
+        header.physics_hz = PHYSICS_HZ;
+        header.world_width = WORLD_WIDTH;
+        header.world_height = WORLD_HEIGHT;
+        header.scale = RECORD_SCALE;
+        header.keyframe_interval = RECORD_KEYFRAME_INTERVAL;
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(balls.radius.data(), sizeof(float), ball_count, file);
+        fwrite(balls.color.data(), sizeof(SDL_Color), ball_count, file);
+        file_offset = sizeof(header) + ball_count * (sizeof(float) + sizeof(SDL_Color));
+        order.resize(ball_count);
+        for (int k = 0; k < ball_count; ++k)
+            order[k] = k;
+
+        stopping = false;
+        frames_dropped = 0;
+        tick = 0;
+        frame_offsets.clear();
+        writer = std::thread([this]() { writer_loop(); });
+        return true;
+    }
+
+    void capture() {
+        if ((int)balls.size() != ball_count) {
+            SDL_Log("Balls were added, recording stopped");
+            stop();
+            return;
+        }
+
+        uint32_t frame_tick = tick++;
+        std::vector<int32_t> frame;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if ((int)pending.size() >= RECORD_MAX_PENDING) {
+                frames_dropped++;
+                return;
+            }
+            if (!spare.empty()) {
+                frame.swap(spare.back());
+                spare.pop_back();
+            }
+        }
+
+        frame.resize(2 * ball_count);
+        for (int k = 0; k < ball_count; ++k) {
+            frame[2 * k] = quantize_position(balls.x[order[k]]);
+            frame[2 * k + 1] = quantize_position(balls.y[order[k]]);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::vector<int32_t>());
+            pending.back().swap(frame);
+            pending_ticks.push_back(frame_tick);
+        }
+        wake.notify_one();
+    }
+
+    void write_frame(const std::vector<int32_t>& frame, uint32_t frame_tick) {
+        bool keyframe = frame_offsets.size() % RECORD_KEYFRAME_INTERVAL == 0;
+        encoded.clear();
+        if (keyframe) {
+            encoded.resize(frame.size() * sizeof(int32_t));
+            memcpy(encoded.data(), frame.data(), encoded.size());
+        } else {
+            for (size_t k = 0; k < frame.size(); ++k)
+                put_varint(encoded, frame[k] - previous[k]);
+        }
+        previous = frame;
+
+        frame_offsets.push_back(file_offset);
+        RecordFrameHeader header;
+        header.keyframe = keyframe ? 1 : 0;
+        header.size = (uint32_t)encoded.size();
+        header.tick = frame_tick;
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(encoded.data(), 1, encoded.size(), file);
+        file_offset += sizeof(header) + encoded.size();
+    }
+
+    void writer_loop() {
+        std::vector<std::vector<int32_t>> batch;
+        std::vector<uint32_t> batch_ticks;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !pending.empty(); });
+                if (pending.empty() && stopping)
+                    break;
+                batch.swap(pending);
+                batch_ticks.swap(pending_ticks);
+            }
+            for (size_t f = 0; f < batch.size(); ++f)
+                write_frame(batch[f], batch_ticks[f]);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (std::vector<int32_t>& frame : batch) {
+                    spare.push_back(std::vector<int32_t>());
+                    spare.back().swap(frame);
+                }
+            }
+            batch.clear();
+            batch_ticks.clear();
+        }
+    }
+
+    void stop() {
+        if (!file)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+
+        RecordFooter footer;
+        footer.index_offset = file_offset;
+        footer.frame_count = (uint32_t)frame_offsets.size();
+        footer.magic = RECORD_INDEX_MAGIC;
+        fwrite(frame_offsets.data(), sizeof(uint64_t), frame_offsets.size(), file);
+        fwrite(&footer, sizeof(footer), 1, file);
+        fclose(file);
+        file = NULL;
+
+        SDL_Log("Recorded %d frames (%d dropped)", (int)footer.frame_count, frames_dropped);
+    }
+
+    ~Recorder() { stop(); }
+};
+
+Recorder recorder;
+
+void start_recording(const char* path) {
+    recorder.start(path);
+}
+
+void record_frame() {
+    if (recorder.active())
+        recorder.capture();
+}
+
+// Шары переставлены или удалены (reorder_remap): в файле порядок остаётся тем, что в заголовке
+void remap_recording() {
+    if (!recorder.active())
+        return;
+    for (int& ball : recorder.order) {
+        ball = reorder_remap[ball];
+        if (ball < 0) {
+            // у записи один набор шаров на всю длину: даже если число сохранится, это другие шары
+            SDL_Log("Balls were removed, recording stopped");
+            recorder.stop();
+            return;
+        }
+    }
+}
+
+void stop_recording() {
+    recorder.stop();
+}
+
+// Воспроизведение: файл целиком отображается в память, кадры декодируются прямо
+// из отображения в balls — симуляция при этом не идёт
+struct Replay {
+    const uint8_t* data = NULL;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+    const RecordHeader* header = NULL;
+    std::vector<uint64_t> frame_offsets;
+    std::vector<uint32_t> frame_ticks;
+    std::vector<int32_t> positions;  // квантованные позиции текущего кадра
+    int frame = -1;
+    uint32_t tick = 0;  // тик воспроизведения: в дыре от выброшенных кадров обгоняет тик кадра
+    bool paused = false;
+
+    bool active() const { return data != NULL; }
+    int frame_count() const { return (int)frame_offsets.size(); }
+
+    bool map(const char* path) {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file, &file_size);
+        size = (size_t)file_size.QuadPart;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping)
+            return false;
+        data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        fstat(fd, &st);
+        size = (size_t)st.st_size;
+        void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        data = mapped == MAP_FAILED ? NULL : (const uint8_t*)mapped;
+#endif
+        return data != NULL;
+    }
+
+    void unmap() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap((void*)data, size);
+#endif
+        data = NULL;
+    }
+
+    bool open_file(const char* path) {
+        if (!map(path) || size < sizeof(RecordHeader)) {
+            SDL_Log("Cannot map replay %s", path);
+            return false;
+        }
+        header = (const RecordHeader*)data;
+        if (header->magic != RECORD_MAGIC || header->version != RECORD_VERSION) {
+            SDL_Log("%s is not a phys2d recording", path);
+            unmap();
+            return false;
+        }
+
+        // кадры идут подряд без выравнивания, поэтому заголовки читаем через memcpy
+        size_t frames_begin = sizeof(RecordHeader) + (size_t)header->ball_count * (sizeof(float) + sizeof(SDL_Color));
+        if (frames_begin > size || header->keyframe_interval == 0 || !(header->scale > 0.0f) ||
+            header->physics_hz == 0 || header->world_width <= 0 || header->world_height <= 0) {
+            SDL_Log("%s: corrupt header", path);
+            unmap();
+            return false;
+        }
+        RecordFooter footer;
+        memcpy(&footer, data + size - sizeof(RecordFooter), sizeof(footer));
+        frame_offsets.clear();
+        frame_ticks.clear();
+        if (size >= frames_begin + sizeof(RecordFooter) && footer.magic == RECORD_INDEX_MAGIC) {
+            // таблица и каждый кадр должны лежать между заголовком и самой таблицей
+            size_t index_end = size - sizeof(RecordFooter);
+            if (footer.index_offset < frames_begin || footer.index_offset > index_end ||
+                footer.frame_count > (index_end - footer.index_offset) / sizeof(uint64_t)) {
+                SDL_Log("%s: frame index points outside the file", path);
+                unmap();
+                return false;
+            }
+            frame_offsets.resize(footer.frame_count);
+            memcpy(frame_offsets.data(), data + footer.index_offset, footer.frame_count * sizeof(uint64_t));
+            for (size_t f = 0; f < frame_offsets.size(); ++f) {
+                if (!valid_frame(f, frame_offsets[f], footer.index_offset)) {
+                    SDL_Log("%s: frame %d is outside the file or corrupt", path, (int)f);
+                    frame_offsets.clear();
+                    frame_ticks.clear();
+                    unmap();
+                    return false;
+                }
+                frame_ticks.push_back(frame_tick(f));
+            }
+        } else {
+            // запись оборвалась без таблицы — восстанавливаем её проходом по кадрам
+            size_t offset = frames_begin;
+            while (valid_frame(frame_offsets.size(), offset, size)) {
+                RecordFrameHeader frame_header;
+                memcpy(&frame_header, data + offset, sizeof(frame_header));
+                frame_offsets.push_back(offset);
+                frame_ticks.push_back(frame_header.tick);
+                offset += sizeof(RecordFrameHeader) + frame_header.size;
+            }
+        }
+        frame = -1;
+        return true;
+    }
+
+    // Кадр index по смещению offset целиком до end, ключевой там, где ему положено, нужного размера,
+    // и его тик позже тика прошлого кадра (frame_ticks заполнены до index)
+    bool valid_frame(size_t index, uint64_t offset, size_t end) const {
+        size_t frames_begin = sizeof(RecordHeader) + (size_t)header->ball_count * (sizeof(float) + sizeof(SDL_Color));
+        if (offset < frames_begin || offset > end || end - offset < sizeof(RecordFrameHeader))
+            return false;
+        RecordFrameHeader frame_header;
+        memcpy(&frame_header, data + offset, sizeof(frame_header));
+        bool keyframe = index % header->keyframe_interval == 0;
+        size_t keyframe_size = 2 * (size_t)header->ball_count * sizeof(int32_t);
+        if (frame_header.keyframe != (keyframe ? 1u : 0u) || frame_header.size == 0 ||
+            (keyframe && frame_header.size != keyframe_size) ||
+            (index > 0 && frame_header.tick <= frame_ticks[index - 1]))
+            return false;
+        return frame_header.size <= end - offset - sizeof(RecordFrameHeader);
+    }
+
+    uint32_t frame_tick(size_t f) const {
+        RecordFrameHeader frame_header;
+        memcpy(&frame_header, data + frame_offsets[f], sizeof(frame_header));
+        return frame_header.tick;
+    }
+
+    // Последний кадр, записанный не позже тика t
+    int frame_at(long long t) const {
+        int f = (int)(std::upper_bound(frame_ticks.begin(), frame_ticks.end(), (uint32_t)std::max(0LL, t)) - frame_ticks.begin());
+        return std::max(0, f - 1);
+    }
+
+    // Загружает шары из заголовка: радиусы и цвета, позиции — из первого кадра
+    void load_balls() {
+        int n = header->ball_count;
+        const float* radius = (const float*)(data + sizeof(RecordHeader));
+        const SDL_Color* color = (const SDL_Color*)(radius + n);
+
+        balls.clear();
+        balls.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            Ball b;
+            b.radius = radius[i];
+            b.color = color[i];
+            balls.push_back(b);
+        }
+        positions.assign(2 * n, 0);
+        seek(0);
+        std::copy(balls.x.begin(), balls.x.end(), balls.tick_x.begin());
+        std::copy(balls.y.begin(), balls.y.end(), balls.tick_y.begin());
+    }
+
+    void decode(int f) {
+        RecordFrameHeader frame_header;
+        memcpy(&frame_header, data + frame_offsets[f], sizeof(frame_header));
+        const uint8_t* p = data + frame_offsets[f] + sizeof(frame_header);
+        const uint8_t* end = p + frame_header.size;
+        int values = (int)positions.size();
+        if (frame_header.keyframe) {
+            memcpy(positions.data(), p, values * sizeof(int32_t));
+        } else {
+            for (int k = 0; k < values; ++k) {
+                int32_t delta;
+                p = get_varint(p, end, delta);
+                positions[k] += delta;
+            }
+        }
+        frame = f;
+    }
+
+    // Переход на любой кадр: от ближайшего ключевого вперёд по разностям
+    void seek(int target) {
+        if (frame_offsets.empty())
+            return;
+        target = std::max(0, std::min(target, frame_count() - 1));
+        if (target != frame) {
+            int start = frame + 1;
+            if (frame < 0 || target < frame || target - frame > (int)header->keyframe_interval)
+                start = target - target % header->keyframe_interval;
+            for (int f = start; f <= target; ++f)
+                decode(f);
+        }
+        tick = frame_ticks[target];
+
+        float inv_scale = 1.0f / header->scale;
+        for (int i = 0; i < (int)header->ball_count; ++i) {
+            balls.x[i] = positions[2 * i] * inv_scale;
+            balls.y[i] = positions[2 * i + 1] * inv_scale;
+        }
+    }
+};
+
+Replay replay;
+
+// Вместо update() в режиме воспроизведения: сдвигаемся на тик, кадр меняется, когда
+// до него дошли — на месте выброшенных кадров стоит прошлый
+void replay_tick() {
+    std::copy(balls.x.begin(), balls.x.end(), balls.tick_x.begin());
+    std::copy(balls.y.begin(), balls.y.end(), balls.tick_y.begin());
+    if (replay.paused || replay.frame + 1 >= replay.frame_count())
+        return;
+    replay.tick++;
+    if (replay.frame_ticks[replay.frame + 1] <= replay.tick)
+        replay.seek(replay.frame + 1);
+}
+
+// Прыжок без интерполяции с прошлого положения
+void replay_seek(int frame) {
+    replay.seek(frame);
+    std::copy(balls.x.begin(), balls.x.end(), balls.tick_x.begin());
+    std::copy(balls.y.begin(), balls.y.end(), balls.tick_y.begin());
+}
+
+bool open_replay(const char* path) {
+    if (!replay.open_file(path))
+        return false;
+    WORLD_WIDTH = replay.header->world_width;
+    WORLD_HEIGHT = replay.header->world_height;
+    PHYSICS_HZ = replay.header->physics_hz;
+    BALLS_COUNT = replay.header->ball_count;
+    return true;
+}
+
+bool replaying() {
+    return replay.active();
+}
+
+void replay_step(int ticks) {
+    replay_seek(replay.frame_at((long long)replay.tick + ticks));
+}
+
+void replay_toggle_pause() {
+    replay.paused = !replay.paused;
+}
+
+void load_replay_balls() {
+    replay.load_balls();
+}
+
+void close_replay() {
+    replay.unmap();
+}
+
+int replay_frame_index() {
+    return replay.frame;
+}
+
+int replay_frame_count() {
+    return replay.frame_count();
+}
+
+bool replay_paused() {
+    return replay.paused;
 }